@@ -10,8 +10,11 @@
  * 2nd and 3rd word in each block, respectively. Of course, each block has
  * their header and footer like the implementation of 'implicit list'.
  *
- * In this implementation, the free list keep the order of the free blocks by
- * their sizes. And if mm_free make some contiguous free blocks, they are
+ * In this implementation, the free blocks are segregated into size classes,
+ * and each class has its own free list which keeps the order of the free
+ * blocks by their sizes. The class boundaries, the heap extension sizes and
+ * the split threshold come from mm_tune.h, which is generated by mmtune from
+ * recorded traces. And if mm_free make some contiguous free blocks, they are
  * coalesced immediately so that we can avoid memory fragmentation.
  */
 
@@ -28,6 +31,7 @@
 
 #include "mm.h"
 #include "memlib.h"
+#include "mm_tune.h"
 
 /* single word (4) or double word (8) alignment */
 #define ALIGNMENT 8
@@ -38,8 +42,6 @@
 /* Basic constants and macros */
 #define WSIZE		4
 #define DSIZE		8
-#define CHUNKSIZE	(1<<12)
-#define INIT_CHUNKSIZE	(1<<6)    
 
 #define MAX(x, y) ((x) > (y) ? (x) : (y)) 
 #define MIN(x, y) ((x) < (y) ? (x) : (y)) 
@@ -71,11 +73,16 @@
 #define FREE_PREV(bp) (*(char **)(bp))
 #define FREE_NEXT(bp) (*(char **)(FREE_NEXT_PTR(bp)))
 
-/* free list */
+/* Given a block size, compute the head of the free list it belongs to */
+#define FREELIST(size) (freelist[size_class(size)])
+
+/* free lists */
 void *heap_listp;
-void *freelist;
+void *freelist[NCLASSES];
+static const size_t class_max[NCLASSES] = SIZE_CLASSES;
 
 /* helper functions */
+static int size_class(size_t size);
 static void *extend_heap(size_t size);
 static void *coalesce(void *bp);
 static void *place(void *ptr, size_t asize);
@@ -96,6 +103,8 @@ int mm_check(void);
  */
 int mm_init(void)
 {
+	int i;
+
 	/* Create the initial empty heap */
 	if ((heap_listp = mem_sbrk(4*WSIZE)) == (void *)-1)
 		return -1;
@@ -105,8 +114,9 @@ int mm_init(void)
 	PUT(heap_listp + (3*WSIZE), PACK(0, 1));
 	heap_listp += (2*WSIZE);
 
-	/* Initialize the free list */
-	freelist = NULL;
+	/* Initialize the free lists */
+	for (i = 0; i < NCLASSES; i++)
+		freelist[i] = NULL;
 
 	/* Extend the empty heap with a free block of INIT_CHUNKSIZE bytes */
 	if (!extend_heap(INIT_CHUNKSIZE/WSIZE))
@@ -124,7 +134,8 @@ void *mm_malloc(size_t size)
 {
 	size_t asize;
 	size_t extendsize;
-	char *bp = freelist;
+	char *bp = NULL;
+	int i;
 
 	/* Ignore spurious requests */
 	if (!size)
@@ -136,9 +147,12 @@ void *mm_malloc(size_t size)
 	else
 		asize = DSIZE * ((size + (DSIZE) + (DSIZE-1)) / DSIZE);
 
-	/* Search the free list for a fit */
-	while (bp && asize > GET_SIZE(HDRP(bp)))
-		bp = FREE_PREV(bp);
+	/* Search the free lists for a fit, starting from the class of asize */
+	for (i = size_class(asize); i < NCLASSES && !bp; i++) {
+		bp = freelist[i];
+		while (bp && asize > GET_SIZE(HDRP(bp)))
+			bp = FREE_PREV(bp);
+	}
 		
 	/* No fit found. Get more memory and place the block */
 	if (!bp) {
@@ -231,6 +245,19 @@ void *mm_realloc(void *ptr, size_t size)
  * Helper Functions
  ********************/
 
+/*
+ * size_class - Find the free list which blocks of the given size belong to
+ */
+static int size_class(size_t size)
+{
+	int i;
+
+	for (i = 0; i < NCLASSES - 1; i++)
+		if (size <= class_max[i])
+			break;
+	return i;
+}
+
 /*
  * extend_heap - Extend the heap
  */
@@ -323,7 +350,7 @@ static void *place(void *bp, size_t asize)
 	}
 
 	/* Allocate large block from the back of the free block */
-	else if (asize >= 100) {
+	else if (asize >= SPLIT_THRESHOLD) {
 		PUT(HDRP(bp), PACK(csize-asize, 0));
 		PUT(FTRP(bp), PACK(csize-asize, 0));
 		PUT(HDRP(NEXT_BLKP(bp)), PACK(asize, 1));
@@ -345,10 +372,11 @@ static void *place(void *bp, size_t asize)
 }
 
 /*
- * insert_node - Insert a node into the free list 
+ * insert_node - Insert a node into the free list of its size class
  */
 static void insert_node(void *ptr, size_t size) {
-	void *prev = freelist;
+	void **listp = &FREELIST(size);
+	void *prev = *listp;
 	void *next = NULL;
 
 	/* Search a location in ascending order */
@@ -371,7 +399,7 @@ static void insert_node(void *ptr, size_t size) {
 			PUT(FREE_PREV_PTR(ptr), (unsigned int)prev);
 			PUT(FREE_NEXT_PTR(prev), (unsigned int)ptr);
 			PUT(FREE_NEXT_PTR(ptr), (unsigned int)NULL);
-			freelist = ptr;
+			*listp = ptr;
 		}
 	}
 
@@ -387,15 +415,17 @@ static void insert_node(void *ptr, size_t size) {
 		else {
 			PUT(FREE_PREV_PTR(ptr), (unsigned int)NULL);
 			PUT(FREE_NEXT_PTR(ptr), (unsigned int)NULL);
-			freelist = ptr;
+			*listp = ptr;
 		}
 	}
 }
 
 /*
- * delete_node - Remove a node from the free list
+ * delete_node - Remove a node from the free list of its size class
  */
 static void delete_node(void *ptr) {
+	void **listp = &FREELIST(GET_SIZE(HDRP(ptr)));
+
 	if (FREE_PREV(ptr)) {
 		/* Has both of previous and next free blocks */
 		if (FREE_NEXT(ptr)) {
@@ -406,7 +436,7 @@ static void delete_node(void *ptr) {
 		/* Has previous free block */
 		else {
 			PUT(FREE_NEXT_PTR(FREE_PREV(ptr)), (unsigned int)NULL);
-			freelist = FREE_PREV(ptr);
+			*listp = FREE_PREV(ptr);
 		}
 	}
 
@@ -417,7 +447,7 @@ static void delete_node(void *ptr) {
 		
 		/* Has no previous nor next free block */
 		else
-			freelist = NULL;
+			*listp = NULL;
 	}
 }
 
@@ -428,16 +458,24 @@ static void delete_node(void *ptr) {
 int mm_check(void)
 {
 	void *bp;
-
-	/* Is every block in the free list marked as free? */
-	for (bp = freelist; bp; bp = FREE_PREV(bp))
-		if (GET_ALLOC(HDRP(bp)))
-			goto fail;
-
-	/* Are there any contiguous free blocks that somehow escaped coalescing? */
-	for (bp = freelist; bp; bp = FREE_PREV(bp))
-		if (FREE_PREV(bp) == PREV_BLKP(bp))
-			goto fail;
+	int i;
+
+	for (i = 0; i < NCLASSES; i++) {
+		/* Is every block in the free list marked as free? */
+		for (bp = freelist[i]; bp; bp = FREE_PREV(bp))
+			if (GET_ALLOC(HDRP(bp)))
+				goto fail;
+
+		/* Is every block in the free list of its own size class? */
+		for (bp = freelist[i]; bp; bp = FREE_PREV(bp))
+			if (size_class(GET_SIZE(HDRP(bp))) != i)
+				goto fail;
+
+		/* Are there any contiguous free blocks that somehow escaped coalescing? */
+		for (bp = freelist[i]; bp; bp = FREE_PREV(bp))
+			if (FREE_PREV(bp) == PREV_BLKP(bp))
+				goto fail;
+	}
 
 	/* Do the pointers in a heap block point to valid heap addresses? */
 	for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
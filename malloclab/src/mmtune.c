@@ -0,0 +1,348 @@
+/*
+ * mmtune.c - offline tuner for the mm.c allocator constants
+ *
+ * mmtune reads a set of malloc lab traces, converts every allocation and
+ * reallocation request into the block size mm.c would actually carve out
+ * of the heap, and builds a histogram of those block sizes. From the
+ * histogram it derives
+ *
+ *   - a size class table for the segregated free lists in mm.c, whose
+ *     boundaries are the equal-frequency quantiles of the block sizes so
+ *     that every list serves roughly the same share of the requests,
+ *   - CHUNKSIZE, the heap extension granularity, from the most frequent
+ *     block size among the larger half of the requests, and
+ *     INIT_CHUNKSIZE from the small requests,
+ *   - SPLIT_THRESHOLD, the block size from which place() carves blocks
+ *     from the back of a free block instead of the front, so that the
+ *     smallest quarter of the requests are packed together.
+ *
+ * The result is written as a C header (mm_tune.h by default) that mm.c
+ * compiles in. Run mdriver afterwards to confirm the utilization and
+ * throughput of the tuned allocator.
+ *
+ * usage: mmtune [-o <header>] [-n <classes>] [-t <tracedir>] [tracefile ...]
+ */
+
+/**************************************************
+ * [2013-11706] Kang Injae,
+ * Dept. of Mechanical & Aerospace Engineering
+ **************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+
+/* Must match the block layout of mm.c */
+#define DSIZE		8
+
+/* Bounds of the generated table */
+#define MAX_CLASSES	32
+#define DEF_CLASSES	12
+
+/* Bounds of the heap extension granularities */
+#define MIN_CHUNKSIZE	(1<<9)
+#define MAX_CHUNKSIZE	(1<<14)
+#define MIN_INIT_CHUNKSIZE	(1<<6)
+
+#define MAXLINE		1024
+
+/********************
+ * data structures
+ ********************/
+
+/* block size histogram sorted by size */
+typedef struct {
+	size_t size;
+	unsigned long cnt;
+} bin_t;
+
+typedef struct {
+	int nbins;
+	int maxbins;
+	unsigned long total;
+	bin_t *bins;
+} hist_t;
+
+static char *default_tracefiles[] = {
+	DEFAULT_TRACEFILES, NULL
+};
+
+/* helper functions */
+static size_t adjust(size_t size);
+static void hist_add(hist_t *hist, size_t size);
+static size_t hist_quantile(hist_t *hist, double q);
+static size_t hist_mode(hist_t *hist, size_t min);
+static int read_trace(hist_t *hist, char *tracedir, char *filename);
+static size_t round_pow2(size_t size, size_t lo, size_t hi);
+static void write_header(FILE *fp, hist_t *hist, int nclasses, int ntraces);
+static void usage(char *prog);
+
+/* main routine */
+int main(int argc, char *argv[])
+{
+	hist_t hist = { 0, 0, 0, NULL };
+	char *outfile = "mm_tune.h";
+	char *tracedir = TRACEDIR;
+	char **tracefiles = default_tracefiles;
+	int nclasses = DEF_CLASSES, ntraces = 0;
+	FILE *fp;
+	int c;
+
+	while ((c = getopt(argc, argv, "o:n:t:h")) != EOF) {
+		switch (c) {
+		case 'o':
+			outfile = optarg;
+			break;
+		case 'n':
+			nclasses = atoi(optarg);
+			if (nclasses < 1 || nclasses > MAX_CLASSES) {
+				fprintf(stderr, "%s: classes must be in [1, %d]\n",
+					argv[0], MAX_CLASSES);
+				exit(1);
+			}
+			break;
+		case 't':
+			tracedir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/* Trace files given on the command line are relative to the cwd */
+	if (optind < argc) {
+		tracefiles = argv + optind;
+		tracedir = "";
+	}
+
+	for (; *tracefiles; tracefiles++, ntraces++)
+		if (read_trace(&hist, tracedir, *tracefiles) < 0)
+			exit(1);
+
+	if (!hist.total) {
+		fprintf(stderr, "%s: no allocation requests found\n", argv[0]);
+		exit(1);
+	}
+
+	if (!(fp = fopen(outfile, "w"))) {
+		perror(outfile);
+		exit(1);
+	}
+	write_header(fp, &hist, nclasses, ntraces);
+	fclose(fp);
+
+	free(hist.bins);
+	return 0;
+}
+
+/********************
+ * Helper Functions
+ ********************/
+
+/*
+ * adjust - Compute the block size mm_malloc allocates for a request
+ */
+static size_t adjust(size_t size)
+{
+	if (size <= DSIZE)
+		return 2 * DSIZE;
+	return DSIZE * ((size + (DSIZE) + (DSIZE-1)) / DSIZE);
+}
+
+/*
+ * hist_add - Count one block of the given size
+ */
+static void hist_add(hist_t *hist, size_t size)
+{
+	int lo = 0, hi = hist->nbins, mid;
+
+	/* Binary search the bin */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (hist->bins[mid].size < size)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	hist->total++;
+	if (lo < hist->nbins && hist->bins[lo].size == size) {
+		hist->bins[lo].cnt++;
+		return;
+	}
+
+	/* Insert a new bin in sorted position */
+	if (hist->nbins == hist->maxbins) {
+		hist->maxbins = hist->maxbins ? 2 * hist->maxbins : 64;
+		if (!(hist->bins = realloc(hist->bins, hist->maxbins * sizeof(bin_t)))) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memmove(hist->bins + lo + 1, hist->bins + lo,
+		(hist->nbins - lo) * sizeof(bin_t));
+	hist->bins[lo].size = size;
+	hist->bins[lo].cnt = 1;
+	hist->nbins++;
+}
+
+/*
+ * hist_quantile - Smallest block size covering the fraction q of requests
+ */
+static size_t hist_quantile(hist_t *hist, double q)
+{
+	unsigned long target = (unsigned long)(q * hist->total), sum = 0;
+	int i;
+
+	for (i = 0; i < hist->nbins; i++) {
+		sum += hist->bins[i].cnt;
+		if (sum >= target)
+			return hist->bins[i].size;
+	}
+	return hist->bins[hist->nbins - 1].size;
+}
+
+/*
+ * hist_mode - Most frequent block size not smaller than min
+ */
+static size_t hist_mode(hist_t *hist, size_t min)
+{
+	unsigned long best = 0;
+	size_t size = min;
+	int i;
+
+	for (i = 0; i < hist->nbins; i++)
+		if (hist->bins[i].size >= min && hist->bins[i].cnt > best) {
+			best = hist->bins[i].cnt;
+			size = hist->bins[i].size;
+		}
+	return size;
+}
+
+/*
+ * read_trace - Add the requests of a trace file to the histogram
+ */
+static int read_trace(hist_t *hist, char *tracedir, char *filename)
+{
+	char path[MAXLINE], type[MAXLINE];
+	unsigned index, size;
+	int header[4];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s%s", tracedir, filename);
+	if (!(fp = fopen(path, "r"))) {
+		perror(path);
+		return -1;
+	}
+
+	/* heap size, ids, ops and weight are not used */
+	if (fscanf(fp, "%d %d %d %d",
+		   &header[0], &header[1], &header[2], &header[3]) != 4) {
+		fprintf(stderr, "%s: bad trace header\n", path);
+		fclose(fp);
+		return -1;
+	}
+
+	while (fscanf(fp, "%s", type) != EOF) {
+		switch (type[0]) {
+		case 'a':
+		case 'r':
+			if (fscanf(fp, "%u %u", &index, &size) != 2)
+				goto bogus;
+			if (size)
+				hist_add(hist, adjust(size));
+			break;
+		case 'f':
+			if (fscanf(fp, "%u", &index) != 1)
+				goto bogus;
+			break;
+		default:
+			goto bogus;
+		}
+	}
+
+	fclose(fp);
+	return 0;
+
+bogus:
+	fprintf(stderr, "%s: bogus request line\n", path);
+	fclose(fp);
+	return -1;
+}
+
+/*
+ * round_pow2 - Round a size up to a power of two within [lo, hi]
+ */
+static size_t round_pow2(size_t size, size_t lo, size_t hi)
+{
+	size_t p = lo;
+
+	while (p < size && p < hi)
+		p <<= 1;
+	return p;
+}
+
+/*
+ * write_header - Emit the tuned constants as a C header
+ */
+static void write_header(FILE *fp, hist_t *hist, int nclasses, int ntraces)
+{
+	size_t bounds[MAX_CLASSES], b;
+	int i, n = 0;
+
+	/* Equal-frequency class boundaries; duplicates collapse */
+	for (i = 1; i < nclasses; i++) {
+		b = hist_quantile(hist, (double)i / nclasses);
+		if (!n || b > bounds[n-1])
+			bounds[n++] = b;
+	}
+
+	/* The largest class is unbounded */
+	if (!n || bounds[n-1] != hist->bins[hist->nbins - 1].size)
+		bounds[n++] = hist->bins[hist->nbins - 1].size;
+	bounds[n-1] = 0;
+
+	fprintf(fp, "/*\n");
+	fprintf(fp, " * mm_tune.h - allocator constants generated by mmtune\n");
+	fprintf(fp, " *\n");
+	fprintf(fp, " * %lu requests, %d distinct block sizes, %d trace(s).\n",
+		hist->total, hist->nbins, ntraces);
+	fprintf(fp, " * Do not edit; rerun mmtune instead.\n");
+	fprintf(fp, " */\n");
+	fprintf(fp, "#ifndef __MM_TUNE_H__\n");
+	fprintf(fp, "#define __MM_TUNE_H__\n\n");
+
+	fprintf(fp, "#define CHUNKSIZE\t%lu\n", (unsigned long)
+		round_pow2(hist_mode(hist, hist_quantile(hist, 0.5)),
+			   MIN_CHUNKSIZE, MAX_CHUNKSIZE));
+	fprintf(fp, "#define INIT_CHUNKSIZE\t%lu\n", (unsigned long)
+		round_pow2(hist_quantile(hist, 0.1), MIN_INIT_CHUNKSIZE, MAX_CHUNKSIZE));
+	fprintf(fp, "#define SPLIT_THRESHOLD\t%lu\n\n", (unsigned long)
+		hist_quantile(hist, 0.25));
+
+	fprintf(fp, "/* Upper bounds of the free list size classes (0: unbounded) */\n");
+	fprintf(fp, "#define NCLASSES\t%d\n", n);
+	fprintf(fp, "#define SIZE_CLASSES\t{");
+	for (i = 0; i < n; i++)
+		fprintf(fp, "%s%lu", i ? ", " : " ", (unsigned long)bounds[i]);
+	fprintf(fp, " }\n\n");
+
+	fprintf(fp, "#endif /* __MM_TUNE_H__ */\n");
+}
+
+/*
+ * usage - Print the usage message and exit
+ */
+static void usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-o <header>] [-n <classes>] [-t <tracedir>] [tracefile ...]\n", prog);
+	fprintf(stderr, "Options\n");
+	fprintf(stderr, "\t-o <header>   Output header (default mm_tune.h).\n");
+	fprintf(stderr, "\t-n <classes>  Number of free list size classes (default %d).\n", DEF_CLASSES);
+	fprintf(stderr, "\t-t <tracedir> Directory of the default trace files.\n");
+	fprintf(stderr, "\t-h            Print this message.\n");
+	exit(1);
+}
@@ -0,0 +1,169 @@
+#include "alog.h"
+
+static void *alog_writer(void *vargp);
+
+/*
+ * Writing the access log from the request path would hold every worker
+ * up behind the stdout lock and behind a slow terminal or pipe. Instead
+ * each thread pushes fixed-size records into a ring of its own, which
+ * only it writes the head of and only the writer thread the tail of, so
+ * no lock is taken. The writer wakes every ALOG_INTERVAL milliseconds,
+ * formats whatever the rings hold and writes it in large batches. A
+ * full ring drops the record and counts it; the writer logs the count.
+ *
+ * Rings are registered on the first record of a thread and live as long
+ * as the process, as the threads that log do.
+ */
+
+static char *alog_cache[] = { "-", "HIT", "STALE", "REVALIDATED", "MISS" };
+
+/*************************
+ * alog_t static methods
+ *************************/
+
+static alogring_t *alog_ring(alog_t *alog)
+{
+	alogring_t *ring;
+
+	if ((ring = pthread_getspecific(alog->ring)))
+		return ring;
+
+	ring = Calloc(1, sizeof(alogring_t));
+	pthread_setspecific(alog->ring, ring);
+
+	/* The writer walks the list without the lock */
+	pthread_mutex_lock(&alog->lock);
+	ring->next = alog->rings;
+	__atomic_store_n(&alog->rings, ring, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&alog->lock);
+
+	return ring;
+}
+
+/* Writes buf out unless a whole line still fits; returns the new length */
+static int alog_room(alog_t *alog, char *buf, int len)
+{
+	if (len <= ALOG_BUFSIZE - ALOG_LINE)
+		return len;
+	rio_writen(alog->fd, buf, len);
+	return 0;
+}
+
+/* Formats the pending records of a ring into buf; returns the new length */
+static int alog_drain(alog_t *alog, alogring_t *ring, char *buf, int len)
+{
+	unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	unsigned long tail;
+	alogrec_t *rec;
+	int n;
+
+	/* A line longer than ALOG_LINE is cut short rather than overflow buf */
+	for (tail = ring->tail; tail != head; tail++) {
+		len = alog_room(alog, buf, len);
+		rec = &ring->recs[tail & (ALOG_RING_SIZE - 1)];
+		n = snprintf(buf + len, ALOG_LINE, "%ld.%06ld %s %016lx %d %ld %ld.%03ld %s\n",
+			     (long)rec->time.tv_sec, (long)rec->time.tv_usec, rec->method,
+			     rec->urihash, rec->status, rec->bytes, rec->latency / 1000,
+			     rec->latency % 1000, alog_cache[rec->cache]);
+		len += n < ALOG_LINE ? n : ALOG_LINE - 1;
+		__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	}
+
+	if (dropped != ring->reported) {
+		len = alog_room(alog, buf, len);
+		n = snprintf(buf + len, ALOG_LINE, "# %lu records dropped\n",
+			     dropped - ring->reported);
+		len += n < ALOG_LINE ? n : ALOG_LINE - 1;
+		ring->reported = dropped;
+	}
+
+	return len;
+}
+
+/* writer thread */
+static void *alog_writer(void *vargp)
+{
+	struct timespec interval = { 0, ALOG_INTERVAL * 1000000L };
+	alog_t *alog = vargp;
+	alogring_t *ring;
+	char *buf = Malloc(ALOG_BUFSIZE);
+	int len;
+
+	Pthread_detach(Pthread_self());
+
+	while (1) {
+		len = 0;
+		for (ring = __atomic_load_n(&alog->rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+			len = alog_drain(alog, ring, buf, len);
+
+		/* A failed write loses the batch; the proxy goes on */
+		if (len)
+			rio_writen(alog->fd, buf, len);
+		nanosleep(&interval, NULL);
+	}
+
+	return NULL;
+}
+
+/********************
+ * alog_t APIs
+ ********************/
+
+void alog_init(alog_t *alog, int fd)
+{
+	pthread_t tid;
+
+	alog->fd = fd;
+	alog->rings = NULL;
+	pthread_mutex_init(&alog->lock, NULL);
+	if (pthread_key_create(&alog->ring, NULL))
+		posix_error(errno, "pthread_key_create error");
+	Pthread_create(&tid, NULL, alog_writer, alog);
+}
+
+/* Starts the record of a request whose head was just read */
+void alog_begin(alogrec_t *rec, char *method, int mlen, char *uri, int urilen)
+{
+	unsigned long hash = 14695981039346656037UL;
+	int i;
+
+	gettimeofday(&rec->time, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &rec->start);
+
+	if (mlen >= sizeof(rec->method))
+		mlen = sizeof(rec->method) - 1;
+	memcpy(rec->method, method, mlen);
+	rec->method[mlen] = '\0';
+
+	/* 64-bit FNV-1a */
+	for (i = 0; i < urilen; i++) {
+		hash ^= (unsigned char)uri[i];
+		hash *= 1099511628211UL;
+	}
+	rec->urihash = hash;
+
+	rec->status = 0;
+	rec->cache = ALOG_NONE;
+	rec->bytes = 0;
+}
+
+/* Completes a record and queues it, or drops it if the ring is full */
+void alog_end(alog_t *alog, alogrec_t *rec)
+{
+	alogring_t *ring = alog_ring(alog);
+	unsigned long head = ring->head;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	rec->latency = (now.tv_sec - rec->start.tv_sec) * 1000000L +
+		       (now.tv_nsec - rec->start.tv_nsec) / 1000;
+
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ALOG_RING_SIZE) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	ring->recs[head & (ALOG_RING_SIZE - 1)] = *rec;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,61 @@
+#ifndef __ALOG_H__
+#define __ALOG_H__
+
+#include "csapp.h"
+
+/* records a thread may have pending; a power of two */
+#define ALOG_RING_SIZE 1024
+
+/* bytes formatted per write, and the longest formatted record */
+#define ALOG_BUFSIZE 65536
+#define ALOG_LINE 128
+
+/* milliseconds the writer sleeps between passes over the rings */
+#define ALOG_INTERVAL 10
+
+/* how the cache took part in a request */
+#define ALOG_NONE 0		/* not cacheable, or not served */
+#define ALOG_HIT 1
+#define ALOG_STALE 2		/* served stale while refreshed */
+#define ALOG_REVALIDATED 3	/* served after a 304 */
+#define ALOG_MISS 4
+
+/********************
+ * data structures
+ ********************/
+
+/* access log record of one request */
+typedef struct {
+	struct timeval time;	/* when the request head was in */
+	struct timespec start;	/* same, on the monotonic clock */
+	char method[8];
+	unsigned long urihash;
+	int status;		/* 0 if nothing was answered */
+	int cache;
+	long bytes;		/* body bytes answered */
+	long latency;		/* microseconds */
+} alogrec_t;
+
+/* records of one thread, pushed by it and drained by the writer */
+typedef struct __alogring {
+	alogrec_t recs[ALOG_RING_SIZE];
+	unsigned long head;	/* next record to push */
+	unsigned long tail;	/* next record to drain */
+	unsigned long dropped;	/* records the full ring turned away */
+	unsigned long reported;	/* drops already logged */
+	struct __alogring *next;
+} alogring_t;
+
+typedef struct {
+	int fd;
+	pthread_key_t ring;	/* ring of the calling thread */
+	pthread_mutex_t lock;	/* serializes ring registration */
+	alogring_t *rings;
+} alog_t;
+
+/* alog_t APIs */
+void alog_init(alog_t *alog, int fd);
+void alog_begin(alogrec_t *rec, char *method, int mlen, char *uri, int urilen);
+void alog_end(alog_t *alog, alogrec_t *rec);
+
+#endif /* __ALOG_H__ */
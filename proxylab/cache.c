@@ -1,145 +1,1185 @@
+#include <malloc.h>
+
 #include "cache.h"
+#include "disk.h"
+#include "hash.h"
+
+/* Heap bytes of a block, with the size word malloc keeps in front of it */
+#define HEAP_SIZE(p) ((long)(malloc_usable_size(p) + sizeof(size_t)))
+
+/*
+ * A cache shared by worker processes takes its blocks from a shared
+ * arena (shm != NULL) instead of the heap; there they may run out
+ */
+static void *mem_alloc(shm_t *shm, size_t size)
+{
+	return shm ? shm_alloc(shm, size) : Malloc(size);
+}
+
+static void mem_free(shm_t *shm, void *ptr)
+{
+	if (shm)
+		shm_free(ptr);
+	else
+		free(ptr);
+}
+
+static long mem_size(shm_t *shm, void *ptr)
+{
+	return shm ? shm_size(ptr) : HEAP_SIZE(ptr);
+}
+
+/*
+ * Objects are collected and kept in fixed-size chunks, so that one of
+ * several megabytes needs no contiguous buffer, is cached by handing
+ * its chunks over rather than copying them, and is dropped half-way
+ * by handing them back. Heap chunks come from slabs, each with a free
+ * list of its own; the slabs with free chunks are listed, and one whose
+ * chunks are all free goes back to the heap unless it is the last such
+ * slab, so that the heap shrinks after churn instead of holding on to
+ * its peak. Chunks of a shared cache are blocks of its arena, which is
+ * a slab allocator of its own.
+ */
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static slab_t *slabs;		/* slabs with free chunks */
+
+#define SLAB_OF(chunk) ((slab_t *)((unsigned long)(chunk) & ~(unsigned long)(SLAB_BYTES - 1)))
+
+/*************************
+ * slab_t static methods
+ *************************/
+
+static void slab_link(slab_t *slab)
+{
+	slab->prev = NULL;
+	slab->next = slabs;
+	if (slabs)
+		slabs->prev = slab;
+	slabs = slab;
+}
+
+static void slab_unlink(slab_t *slab)
+{
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		slabs = slab->next;
+	if (slab->next)
+		slab->next->prev = slab->prev;
+}
+
+/*
+ * Slabs are mapped rather than malloced, so that unmapping one really
+ * gives its pages back; twice the size is mapped, and the slack around
+ * the aligned slab unmapped again
+ */
+static slab_t *slab_new(void)
+{
+	int i, stride = sizeof(chunk_t) + CHUNK_DATA;
+	char *map, *end;
+	chunk_t *chunk;
+	slab_t *slab;
+
+	map = mmap(NULL, 2 * SLAB_BYTES, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		unix_error("mmap error");
+	end = map + 2 * SLAB_BYTES;
+	slab = (slab_t *)(((unsigned long)map + SLAB_BYTES - 1) & ~(unsigned long)(SLAB_BYTES - 1));
+	if ((char *)slab > map)
+		Munmap(map, (char *)slab - map);
+	if ((char *)slab + SLAB_BYTES < end)
+		Munmap((char *)slab + SLAB_BYTES, end - ((char *)slab + SLAB_BYTES));
+
+	slab->free = NULL;
+	for (i = SLAB_CHUNKS - 1; i >= 0; i--) {
+		chunk = (chunk_t *)(slab->chunks + i * stride);
+		chunk->next = slab->free;
+		slab->free = chunk;
+	}
+	slab->nfree = SLAB_CHUNKS;
+	slab_link(slab);
+	return slab;
+}
+
+/* Takes a chunk back into its slab; slab_lock is held */
+static void slab_put(chunk_t *chunk)
+{
+	slab_t *slab = SLAB_OF(chunk);
+
+	chunk->next = slab->free;
+	slab->free = chunk;
+	if (!slab->nfree++)
+		slab_link(slab);
+	else if (slab->nfree == SLAB_CHUNKS && (slabs != slab || slab->next)) {
+		slab_unlink(slab);
+		Munmap(slab, SLAB_BYTES);
+	}
+}
+
+/*************************
+ * chunk_t static methods
+ *************************/
+
+static chunk_t *chunk_new(shm_t *shm)
+{
+	slab_t *slab;
+	chunk_t *chunk;
+
+	if (shm)
+		chunk = shm_alloc(shm, sizeof(chunk_t) + CHUNK_DATA);
+	else {
+		pthread_mutex_lock(&slab_lock);
+		slab = slabs ? slabs : slab_new();
+		chunk = slab->free;
+		slab->free = chunk->next;
+		if (!--slab->nfree)
+			slab_unlink(slab);
+		pthread_mutex_unlock(&slab_lock);
+	}
+
+	if (chunk) {
+		chunk->next = NULL;
+		chunk->len = 0;
+		chunk->own = 0;
+	}
+	return chunk;
+}
+
+/* Frees a list of chunks; slab ones go back to their slabs at once */
+static void chunk_free(shm_t *shm, chunk_t *chunk)
+{
+	chunk_t *next;
+
+	if (shm) {
+		for (; chunk; chunk = next) {
+			next = chunk->next;
+			shm_free(chunk);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&slab_lock);
+	for (; chunk; chunk = next) {
+		next = chunk->next;
+		if (chunk->own)
+			free(chunk);
+		else
+			slab_put(chunk);
+	}
+	pthread_mutex_unlock(&slab_lock);
+}
+
+/*
+ * A copy of a chunk that is mostly empty, in a block of its own size,
+ * or the chunk itself if that would save little or there is no room
+ */
+static chunk_t *chunk_trim(shm_t *shm, chunk_t *chunk)
+{
+	chunk_t *copy;
+
+	if (chunk->len > CHUNK_DATA / 2 || !(copy = mem_alloc(shm, sizeof(chunk_t) + chunk->len)))
+		return chunk;
+
+	memcpy(copy, chunk, sizeof(chunk_t) + chunk->len);
+	copy->own = 1;
+	chunk->next = NULL;
+	chunk_free(shm, chunk);
+	return copy;
+}
+
+/* Bytes a chunk takes */
+static long chunk_charge(shm_t *shm, chunk_t *chunk)
+{
+	if (shm)
+		return shm_size(chunk);
+	return chunk->own ? HEAP_SIZE(chunk) : CHUNK_BLOCK;
+}
+
+/*************************
+ * obj_t static methods
+ *************************/
+
+static obj_t *obj_acquire(obj_t *obj)
+{
+	__sync_add_and_fetch(&obj->refcnt, 1);
+	return obj;
+}
+
+/*
+ * Makes an object of the chunks of buf, which is left empty; NULL if
+ * there is no room for the object itself. A small last chunk is copied
+ * into a block of its own size, so that small objects do not take a
+ * whole chunk each.
+ */
+static obj_t *obj_adopt(buf_t *buf)
+{
+	chunk_t **link;
+	obj_t *obj;
+
+	if (!(obj = mem_alloc(buf->shm, sizeof(obj_t))))
+		return NULL;
+
+	for (link = &buf->head; *link && (*link)->next; link = &(*link)->next)
+		;
+	if (*link)
+		*link = chunk_trim(buf->shm, *link);
+
+	obj->refcnt = 1;
+	obj->size = buf->cnt;
+	obj->mapped = 0;
+	obj->shared = buf->shm != NULL;
+	obj->chunks = buf->head;
+	obj->data = buf->head ? buf->head->data : obj->bytes;
+	obj->len = buf->head ? buf->head->len : 0;
+
+	buf->head = buf->tail = NULL;
+	buf->cnt = 0;
+	return obj;
+}
+
+/* Bytes an object takes, chunks included */
+static long obj_charge(obj_t *obj)
+{
+	chunk_t *chunk;
+	shm_t *shm;
+	long charge;
+
+	/* A snapshot object takes its bytes of the mapping instead */
+	if (obj->mapped)
+		return sizeof(obj_t) + obj->size;
+
+	shm = obj->shared ? shm_of(obj) : NULL;
+	charge = mem_size(shm, obj);
+	for (chunk = obj->chunks; chunk; chunk = chunk->next)
+		charge += chunk_charge(shm, chunk);
+	return charge;
+}
 
 /*************************
  * node_t static methods
  *************************/
 
-static node_t *node_new(char *uri, buf_t *buf)
+/*
+ * The URI is kept at its length in the same block as the node; takes
+ * over the object, and releases it if there is no room for the node
+ */
+static node_t *node_new(shm_t *shm, char *uri, unsigned long hash, obj_t *obj, time_t expires)
 {
-	node_t *node = Malloc(sizeof(node_t));
-	int size = buf->cnt;
+	int len = strlen(uri) + 1;
+	node_t *node;
+
+	if (!(node = mem_alloc(shm, sizeof(node_t) + len))) {
+		obj_release(obj);
+		return NULL;
+	}
+	memcpy(node->uri, uri, len);
+	node->obj = obj;
 
-	node->uri = Malloc(MAXURI);
-	node->node_buf = Malloc(size);
+	node->charge = mem_size(shm, node) + obj_charge(obj);
 
-	node->bufsize = size;
-	strncpy(node->uri, uri, strlen(uri));
-	strncpy(node->node_buf, buf->buf, size);
-	node->next = NULL;
+	node->hash = hash;
+	node->expires = expires;
+	node->protected = 0;
+	node->hnext = node->prev = node->next = NULL;
 
 	return node;
 }
 
-static void node_delete(node_t *node)
+/* Readers may still hold the object; it goes away with the last of them */
+static void node_delete(shm_t *shm, node_t *node)
 {
-	free(node->uri);
-	free(node->node_buf);
-	free(node);
+	obj_release(node->obj);
+	mem_free(shm, node);
 }
 
 /*************************
- * cache_t static methods
+ * shard_t static methods
  *************************/
 
-static int cache_isempty(cache_t *cache)
+/*
+ * Every shard indexes its nodes with a chained hash table and keeps them
+ * on doubly linked LRU lists, so lookup, promotion and eviction are all
+ * constant-time. Readers hold the shard lock shared and only take the
+ * short lru_lock to promote a hit; writers hold the shard lock exclusively,
+ * which keeps every reader out of both structures.
+ *
+ * A shard in shared memory takes a robust process-shared mutex, xlock,
+ * in place of both, since a worker process may die holding it. The next
+ * one to lock it cannot trust the half-updated structures and empties
+ * the shard, leaking its nodes, rather than lose the whole cache.
+ *
+ * Under CACHE_LRU every node lives on the probation list, which is then a
+ * plain LRU list. Under CACHE_TINYLFU the lists form a segmented LRU: new
+ * nodes enter probation, a hit moves them to the protected segment, and
+ * the protected overflow falls back to the head of probation, so victims
+ * are taken from probation first. A new object is admitted only if the
+ * count-min sketch estimates it more popular than every victim it would
+ * displace, which keeps one-hit wonders from flushing the cache.
+ */
+
+static void shard_init(shard_t *shard, int policy, long capacity, shm_t *shm)
+{
+	pthread_mutexattr_t attr;
+
+	shard->shm = shm;
+	shard->capacity = capacity;
+	shard->cnt = 0;
+	shard->nbuckets = SHARD_BUCKETS;
+	shard->policy = policy;
+	if (!(shard->buckets = mem_alloc(shm, SHARD_BUCKETS * sizeof(node_t *))))
+		app_error("shared cache too small");
+	memset(shard->buckets, 0, SHARD_BUCKETS * sizeof(node_t *));
+	shard->size = mem_size(shm, shard->buckets);
+	memset(&shard->probation, 0, sizeof(lru_t));
+	memset(&shard->protected, 0, sizeof(lru_t));
+	memset(shard->sketch, 0, sizeof(shard->sketch));
+	shard->additions = 0;
+	shard->evictions = 0;
+
+	if (!shm) {
+		pthread_rwlock_init(&shard->lock, NULL);
+		pthread_mutex_init(&shard->lru_lock, NULL);
+		return;
+	}
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&shard->xlock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+/*
+ * Forgets every node of a shard whose lock holder died. The first
+ * SHARD_BUCKETS buckets exist whichever table the holder left behind.
+ */
+static void shard_flush(shard_t *shard)
+{
+	memset(shard->buckets, 0, SHARD_BUCKETS * sizeof(node_t *));
+	shard->nbuckets = SHARD_BUCKETS;
+	shard->size = mem_size(shard->shm, shard->buckets);
+	shard->cnt = 0;
+	memset(&shard->probation, 0, sizeof(lru_t));
+	memset(&shard->protected, 0, sizeof(lru_t));
+}
+
+static void shard_xlock(shard_t *shard)
+{
+	if (pthread_mutex_lock(&shard->xlock) == EOWNERDEAD) {
+		shard_flush(shard);
+		pthread_mutex_consistent(&shard->xlock);
+	}
+}
+
+static void shard_rdlock(shard_t *shard)
+{
+	if (shard->shm)
+		shard_xlock(shard);
+	else
+		pthread_rwlock_rdlock(&shard->lock);
+}
+
+static void shard_wrlock(shard_t *shard)
+{
+	if (shard->shm)
+		shard_xlock(shard);
+	else
+		pthread_rwlock_wrlock(&shard->lock);
+}
+
+static void shard_unlock(shard_t *shard)
 {
-	if (cache->head)	
-		return 0;
+	if (shard->shm)
+		pthread_mutex_unlock(&shard->xlock);
 	else
+		pthread_rwlock_unlock(&shard->lock);
+}
+
+/* The shard lock covers the LRU lists already when it is exclusive */
+static void shard_lru_lock(shard_t *shard)
+{
+	if (!shard->shm)
+		pthread_mutex_lock(&shard->lru_lock);
+}
+
+static void shard_lru_unlock(shard_t *shard)
+{
+	if (!shard->shm)
+		pthread_mutex_unlock(&shard->lru_lock);
+}
+
+static node_t **shard_bucket(shard_t *shard, unsigned long hash)
+{
+	/* The low bits already picked the shard */
+	return &shard->buckets[(hash / CACHE_SHARDS) & (shard->nbuckets - 1)];
+}
+
+static node_t *shard_find(shard_t *shard, char *uri, unsigned long hash)
+{
+	node_t *node;
+
+	for (node = *shard_bucket(shard, hash); node; node = node->hnext)
+		if (node->hash == hash && !strcmp(node->uri, uri))
+			return node;
+
+	return NULL;
+}
+
+/* A shared arena out of room leaves the chains longer */
+static void shard_rehash(shard_t *shard)
+{
+	node_t **old = shard->buckets, **new, *node, *next, **bucket;
+	int i, n = shard->nbuckets;
+
+	if (!(new = mem_alloc(shard->shm, 2 * n * sizeof(node_t *))))
+		return;
+	memset(new, 0, 2 * n * sizeof(node_t *));
+	shard->nbuckets = 2 * n;
+	shard->buckets = new;
+
+	for (i = 0; i < n; i++)
+		for (node = old[i]; node; node = next) {
+			next = node->hnext;
+			bucket = shard_bucket(shard, node->hash);
+			node->hnext = *bucket;
+			*bucket = node;
+		}
+
+	shard->size += mem_size(shard->shm, new) - mem_size(shard->shm, old);
+	mem_free(shard->shm, old);
+}
+
+/* Row i of the sketch is indexed by double hashing */
+static int sketch_index(unsigned long hash, int i)
+{
+	unsigned long h2 = (hash >> 16) | 1;
+
+	return ((hash / CACHE_SHARDS) + i * h2) & (SKETCH_WIDTH - 1);
+}
+
+static int shard_frequency(shard_t *shard, unsigned long hash)
+{
+	int i, c, freq = SKETCH_MAX;
+
+	for (i = 0; i < SKETCH_DEPTH; i++)
+		if ((c = shard->sketch[i][sketch_index(hash, i)]) < freq)
+			freq = c;
+
+	return freq;
+}
+
+/* Conservative update: only the minimal counters grow */
+static void shard_record(shard_t *shard, unsigned long hash)
+{
+	int i, j, freq = shard_frequency(shard, hash);
+	unsigned char *c;
+
+	if (freq == SKETCH_MAX)
+		return;
+
+	for (i = 0; i < SKETCH_DEPTH; i++) {
+		c = &shard->sketch[i][sketch_index(hash, i)];
+		if (*c == freq)
+			(*c)++;
+	}
+
+	/* Aging: halve every counter so that old popularity fades */
+	if (++shard->additions == SKETCH_SAMPLE) {
+		for (i = 0; i < SKETCH_DEPTH; i++)
+			for (j = 0; j < SKETCH_WIDTH; j++)
+				shard->sketch[i][j] >>= 1;
+		shard->additions /= 2;
+	}
+}
+
+static void lru_unlink(lru_t *lru, node_t *node)
+{
+	if (node->prev)
+		node->prev->next = node->next;
+	else
+		lru->head = node->next;
+
+	if (node->next)
+		node->next->prev = node->prev;
+	else
+		lru->tail = node->prev;
+
+	node->prev = node->next = NULL;
+	lru->size -= node->charge;
+}
+
+static void lru_push(lru_t *lru, node_t *node)
+{
+	node->prev = NULL;
+	node->next = lru->head;
+
+	if (lru->head)
+		lru->head->prev = node;
+	else
+		lru->tail = node;
+
+	lru->head = node;
+	lru->size += node->charge;
+}
+
+static lru_t *shard_lru(shard_t *shard, node_t *node)
+{
+	return node->protected ? &shard->protected : &shard->probation;
+}
+
+static void shard_promote(shard_t *shard, node_t *node)
+{
+	node_t *demoted;
+
+	shard_lru_lock(shard);
+
+	if (shard->policy == CACHE_TINYLFU) {
+		shard_record(shard, node->hash);
+		lru_unlink(shard_lru(shard, node), node);
+		node->protected = 1;
+		lru_push(&shard->protected, node);
+
+		while (shard->protected.size > shard->capacity / 100 * PROTECTED_RATIO) {
+			demoted = shard->protected.tail;
+			lru_unlink(&shard->protected, demoted);
+			demoted->protected = 0;
+			lru_push(&shard->probation, demoted);
+		}
+	}
+	else if (shard->probation.head != node) {
+		lru_unlink(&shard->probation, node);
+		lru_push(&shard->probation, node);
+	}
+
+	shard_lru_unlock(shard);
+}
+
+/* Counts a miss towards the popularity of a URI not cached yet */
+static void shard_miss(shard_t *shard, unsigned long hash)
+{
+	if (shard->policy != CACHE_TINYLFU)
+		return;
+
+	shard_lru_lock(shard);
+	shard_record(shard, hash);
+	shard_lru_unlock(shard);
+}
+
+/* The victims in eviction order: probation first, then protected */
+static node_t *shard_victim(shard_t *shard, node_t *prev)
+{
+	if (!prev)
+		return shard->probation.tail ? shard->probation.tail : shard->protected.tail;
+	if (prev->prev)
+		return prev->prev;
+	return prev->protected ? NULL : shard->protected.tail;
+}
+
+/* TinyLFU: the candidate must be more popular than everything it evicts */
+static int shard_admit(shard_t *shard, node_t *node)
+{
+	node_t *victim = NULL;
+	long need = shard->size + node->charge - shard->capacity;
+	int freq;
+
+	if (shard->policy != CACHE_TINYLFU || need <= 0)
 		return 1;
+
+	freq = shard_frequency(shard, node->hash);
+	while (need > 0 && (victim = shard_victim(shard, victim))) {
+		if (shard_frequency(shard, victim->hash) >= freq)
+			return 0;
+		need -= victim->charge;
+	}
+
+	return 1;
+}
+
+static void shard_enqueue(shard_t *shard, node_t *node)
+{
+	node_t **bucket;
+
+	if (shard->cnt >= shard->nbuckets)
+		shard_rehash(shard);
+
+	bucket = shard_bucket(shard, node->hash);
+	node->hnext = *bucket;
+	*bucket = node;
+	lru_push(&shard->probation, node);
+
+	shard->cnt++;
+	shard->size += node->charge;
 }
 
-static void cache_enqueue(cache_t *cache, node_t *node)
+static void shard_remove(shard_t *shard, node_t *node)
 {
-	cache->size += (node->bufsize + MAXURI);
-	node->next = cache->head;
-	cache->head = node;
+	node_t **link;
+
+	for (link = shard_bucket(shard, node->hash); *link != node; link = &(*link)->hnext)
+		;
+	*link = node->hnext;
+	node->hnext = NULL;
+	lru_unlink(shard_lru(shard, node), node);
+
+	shard->cnt--;
+	shard->size -= node->charge;
 }
 
-static node_t *cache_dequeue(cache_t *cache)
+static node_t *shard_dequeue(shard_t *shard)
 {
-	node_t *node, *temp;
+	node_t *node;
 
-	if (cache_isempty(cache))
-		return NULL;
+	if ((node = shard_victim(shard, NULL)))
+		shard_remove(shard, node);
+	return node;
+}
 
-	node = cache->head;
-	while (node->next->next)
-		node = node->next;
+/* Returns the victims chained on hnext, to be disposed of unlocked */
+static node_t *shard_evict(shard_t *shard, long request)
+{
+	node_t *victims = NULL, *node;
 
-	temp = node->next;
-	node->next = NULL;
+	while (shard->cnt && shard->size + request > shard->capacity) {
+		node = shard_dequeue(shard);
+		node->hnext = victims;
+		victims = node;
+		shard->evictions++;
+	}
 
-	cache->size -= (temp->bufsize + MAXURI);
-	return temp;
+	return victims;
 }
 
-static node_t *cache_remove_next(cache_t *cache, node_t *node)
+/*************************
+ * cache_t static methods
+ *************************/
+
+/*
+ * Takes over the node; evicted objects spill to the disk tier. A new
+ * version replaces the cached one, while a copy promoted from disk
+ * yields to whatever was cached in the meantime.
+ */
+static void cache_insert(cache_t *cache, shard_t *shard, node_t *node, int replace)
 {
-	node_t *temp;
+	node_t *victims = NULL, *old;
 
-	if (!(temp = node->next))
-		return NULL;
+	if (!node)
+		return;
 
-	node->next = temp->next;
-	temp->next = NULL;
+	/* An object larger than a whole shard would only flush it */
+	if (node->charge > shard->capacity) {
+		node_delete(shard->shm, node);
+		return;
+	}
+
+	shard_wrlock(shard);
 
-	cache->size -= (temp->bufsize + MAXURI);
-	return temp;
+	if ((old = shard_find(shard, node->uri, node->hash))) {
+		if (!replace) {
+			shard_unlock(shard);
+			node_delete(shard->shm, node);
+			return;
+		}
+		shard_remove(shard, old);
+		node_delete(shard->shm, old);
+	}
+	else if (!shard_admit(shard, node)) {
+		shard_unlock(shard);
+		node_delete(shard->shm, node);
+		return;
+	}
+
+	victims = shard_evict(shard, node->charge);
+	shard_enqueue(shard, node);
+	shard_unlock(shard);
+
+	for (node = victims; node; node = victims) {
+		victims = node->hnext;
+		if (cache->disk)
+			disk_put(cache->disk, node->uri, node->obj, node->expires);
+		node_delete(shard->shm, node);
+	}
 }
 
-static void cache_evict(cache_t *cache, int request)
+/* Snapshot records and the objects in them are 8-byte aligned */
+#define SNAP_ALIGN(n) (((n) + 7) & ~7)
+
+/* Writes an object whole, its pointers left for the loader to set */
+static int cache_save_obj(FILE *fp, obj_t *obj)
 {
-	while (cache->size + (request + MAXURI) > MAX_CACHE_SIZE)
-		node_delete(cache_dequeue(cache));
+	chunk_t *chunk;
+
+	if (fwrite(obj, sizeof(obj_t), 1, fp) != 1
+	    || fwrite(obj->data, 1, obj->len, fp) != obj->len)
+		return -1;
+	for (chunk = obj->chunks ? obj->chunks->next : NULL; chunk; chunk = chunk->next)
+		if (fwrite(chunk->data, 1, chunk->len, fp) != chunk->len)
+			return -1;
+	return 0;
+}
+
+/* Writes one LRU list from its tail, so that reloading restores the order */
+static int cache_save_lru(FILE *fp, lru_t *lru)
+{
+	static const char zero[8];
+	snaprec_t rec;
+	node_t *node;
+	int len;
+
+	for (node = lru->tail; node; node = node->prev) {
+		len = strlen(node->uri) + 1;
+		rec.magic = SNAPSHOT_MAGIC;
+		rec.protected = node->protected;
+		rec.urilen = SNAP_ALIGN(len);
+		rec.size = node->obj->size;
+		rec.expires = node->expires;
+
+		if (fwrite(&rec, sizeof(rec), 1, fp) != 1
+		    || fwrite(node->uri, 1, len, fp) != len
+		    || fwrite(zero, 1, rec.urilen - len, fp) != rec.urilen - len
+		    || cache_save_obj(fp, node->obj) < 0
+		    || fwrite(zero, 1, SNAP_ALIGN(rec.size) - rec.size, fp) != SNAP_ALIGN(rec.size) - rec.size)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Links a node of a snapshot in at the head of its list */
+static void shard_restore(shard_t *shard, node_t *node, int protected)
+{
+	shard_enqueue(shard, node);
+
+	if (protected && shard->policy == CACHE_TINYLFU) {
+		lru_unlink(&shard->probation, node);
+		node->protected = 1;
+		lru_push(&shard->protected, node);
+	}
 }
 
 /********************
  * buf_t APIs
  ********************/
 
+buf_t *buf_new(cache_t *cache)
+{
+	buf_t *buf = Malloc(sizeof(buf_t));
+
+	buf->cnt = 0;
+	buf->max = cache->max_object;
+	buf->shm = cache->shm;
+	buf->head = buf->tail = NULL;
+
+	return buf;
+}
+
+void buf_delete(buf_t *buf)
+{
+	if (buf) {
+		buf_clear(buf);
+		free(buf);
+	}
+}
+
+/* Drops whatever was collected, handing the chunks back under one lock */
 void buf_clear(buf_t *buf)
 {
+	chunk_free(buf->shm, buf->head);
+	buf->head = buf->tail = NULL;
 	buf->cnt = 0;
 }
 
+/*
+ * Appends n bytes, chunk by chunk; -1 if the object gets too large or
+ * the shared arena is full, which drops it and fails every later call
+ */
 int buf_fill(buf_t *buf, void *usrbuf, size_t n)
 {
-	if (buf->cnt + n > MAX_OBJECT_SIZE)
+	chunk_t *chunk;
+	char *p = usrbuf;
+	int len;
+
+	if (buf->cnt + n > buf->max) {
+		buf_clear(buf);
+		buf->max = 0;
 		return -1;
+	}
 
-	strncpy(buf->buf + buf->cnt, usrbuf, n);
-	buf->cnt += n;
+	while (n > 0) {
+		if (!buf->tail || buf->tail->len == CHUNK_DATA) {
+			if (!(chunk = chunk_new(buf->shm))) {
+				buf_clear(buf);
+				buf->max = 0;
+				return -1;
+			}
+			if (buf->tail)
+				buf->tail->next = chunk;
+			else
+				buf->head = chunk;
+			buf->tail = chunk;
+		}
+
+		len = CHUNK_DATA - buf->tail->len;
+		if (len > n)
+			len = n;
+		memcpy(buf->tail->data + buf->tail->len, p, len);
+		buf->tail->len += len;
+		buf->cnt += len;
+		p += len;
+		n -= len;
+	}
 
 	return 0;
 }
 
 /********************
- * cache_t APIs
+ * obj_t APIs
  ********************/
 
-void cache_init(cache_t *cache)
+/* An object of the size bytes at data, in one heap block */
+obj_t *obj_new(void *data, int size)
 {
-	cache->size = 0;
-	cache->head = NULL;
+	obj_t *obj = Malloc(sizeof(obj_t) + size);
+
+	obj->refcnt = 1;
+	obj->size = obj->len = size;
+	obj->mapped = obj->shared = 0;
+	obj->data = obj->bytes;
+	obj->chunks = NULL;
+	memcpy(obj->bytes, data, size);
+
+	return obj;
 }
 
-int cache_read(cache_t *cache, char *uri, buf_t *buf)
+void obj_release(obj_t *obj)
 {
-	node_t *prev, *node;
+	shm_t *shm;
 
-	if (!(prev = cache->head))
-		return -1;
-	
-	node = prev->next;
-	while (node) {
-		if (!strncmp(node->uri, uri, strlen(uri))) {
-			strncpy(buf->buf, node->node_buf, node->bufsize);
-			buf->cnt = node->bufsize;
-			cache_enqueue(cache, cache_remove_next(cache, prev));
-			return node->bufsize;
+	if (__sync_sub_and_fetch(&obj->refcnt, 1) || obj->mapped)
+		return;
+
+	shm = obj->shared ? shm_of(obj) : NULL;
+	chunk_free(shm, obj->chunks);
+	mem_free(shm, obj);
+}
+
+/*
+ * Points up to max iovecs at the n bytes of an object from offset off
+ * on, moving off and n past them; returns the number of iovecs used
+ */
+int obj_iov(obj_t *obj, long *off, long *n, struct iovec *iov, int max)
+{
+	chunk_t *chunk = obj->chunks ? obj->chunks->next : NULL;
+	char *p = obj->data;
+	long len = obj->len, skip = *off;
+	int cnt = 0;
+
+	while (cnt < max && *n > 0) {
+		if (skip < len) {
+			iov[cnt].iov_base = p + skip;
+			iov[cnt].iov_len = len - skip < *n ? len - skip : *n;
+			*off += iov[cnt].iov_len;
+			*n -= iov[cnt++].iov_len;
+			skip = 0;
 		}
-		prev = node;
-		node = node->next;
+		else
+			skip -= len;
+
+		if (!chunk)
+			break;
+		p = chunk->data;
+		len = chunk->len;
+		chunk = chunk->next;
 	}
 
+	return cnt;
+}
+
+/* Copies all the bytes of an object to dst */
+void obj_copy(obj_t *obj, char *dst)
+{
+	chunk_t *chunk;
+
+	memcpy(dst, obj->data, obj->len);
+	dst += obj->len;
+	for (chunk = obj->chunks ? obj->chunks->next : NULL; chunk; chunk = chunk->next) {
+		memcpy(dst, chunk->data, chunk->len);
+		dst += chunk->len;
+	}
+}
+
+/********************
+ * cache_t APIs
+ ********************/
+
+/* Maps a policy name to its CACHE_* constant, or -1 */
+int cache_policy(char *name)
+{
+	if (!strcmp(name, "lru"))
+		return CACHE_LRU;
+	if (!strcmp(name, "tinylfu"))
+		return CACHE_TINYLFU;
 	return -1;
 }
 
-void cache_write(cache_t *cache, char *uri, buf_t *buf)
+/* Parses a size of bytes with an optional k, m or g suffix, or -1 */
+long cache_parse_size(char *arg)
+{
+	char *end;
+	long size = strtol(arg, &end, 10);
+
+	switch (*end) {
+	case 'g': case 'G':
+		size <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		size <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		size <<= 10;
+		end++;
+	}
+
+	return end == arg || *end || size <= 0 ? -1 : size;
+}
+
+/*
+ * The capacity is split evenly among the shards and bounds the heap
+ * bytes of the cached nodes, URIs and objects, malloc overhead included,
+ * along with the hash tables. Objects still being collected, and one
+ * spare slab of free chunks, come on top of it. A shared cache lives in
+ * an arena mapped for the processes forked after this, and is never
+ * freed.
+ */
+void cache_init(cache_t *cache, int policy, long capacity, int max_object, int shared)
 {
-	node_t *node = node_new(uri, buf);
-	cache_evict(cache, node->bufsize);
-	cache_enqueue(cache, node);
+	int i;
+
+	cache->shm = NULL;
+	if (shared) {
+		/*
+		 * Room for the shards, for the responses being collected and
+		 * for fragmentation; pages are only backed once touched
+		 */
+		cache->shm = shm_create(2 * capacity + CACHE_SHARDS * sizeof(shard_t),
+					CACHE_SHM_BLOCK);
+		cache->shards = shm_alloc(cache->shm, CACHE_SHARDS * sizeof(shard_t));
+	}
+	else
+		cache->shards = Malloc(CACHE_SHARDS * sizeof(shard_t));
+
+	for (i = 0; i < CACHE_SHARDS; i++)
+		shard_init(&cache->shards[i], policy, capacity / CACHE_SHARDS, cache->shm);
+	cache->max_object = max_object;
+	cache->disk = NULL;
+}
+
+void cache_deinit(cache_t *cache)
+{
+	shard_t *shard;
+	int i;
+
+	if (cache->shm)
+		return;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		shard = &cache->shards[i];
+		while (shard->cnt)
+			node_delete(NULL, shard_dequeue(shard));
+		free(shard->buckets);
+		pthread_rwlock_destroy(&shard->lock);
+		pthread_mutex_destroy(&shard->lru_lock);
+	}
+	free(cache->shards);
 }
 
+/*
+ * Returns the pinned object, fresh or not, and its expiry time through
+ * expires unless it is NULL; the caller must obj_release() it
+ */
+obj_t *cache_read(cache_t *cache, char *uri, time_t *expires)
+{
+	unsigned long hash = fnv1a(uri);
+	shard_t *shard = &cache->shards[hash % CACHE_SHARDS];
+	node_t *node;
+	obj_t *obj = NULL;
+	time_t exp = 0;
+
+	shard_rdlock(shard);
+	if ((node = shard_find(shard, uri, hash))) {
+		obj = obj_acquire(node->obj);
+		exp = node->expires;
+		shard_promote(shard, node);
+	}
+	else
+		shard_miss(shard, hash);
+	shard_unlock(shard);
+
+	/* A hit on disk is promoted back to memory */
+	if (!obj && cache->disk && (obj = disk_get(cache->disk, uri, &exp)))
+		cache_insert(cache, shard, node_new(shard->shm, uri, hash, obj_acquire(obj), exp), 0);
+
+	if (expires)
+		*expires = exp;
+	return obj;
+}
+
+/*
+ * Caches a new version of the object, fresh until expires, taking over
+ * the chunks of buf; a full shared arena leaves it uncached
+ */
+void cache_write(cache_t *cache, char *uri, buf_t *buf, time_t expires)
+{
+	unsigned long hash = fnv1a(uri);
+	shard_t *shard = &cache->shards[hash % CACHE_SHARDS];
+	obj_t *obj;
+
+	if ((obj = obj_adopt(buf)))
+		cache_insert(cache, shard, node_new(shard->shm, uri, hash, obj, expires), 1);
+}
+
+/* Extends the freshness of a cached object that was revalidated */
+void cache_refresh(cache_t *cache, char *uri, time_t expires)
+{
+	unsigned long hash = fnv1a(uri);
+	shard_t *shard = &cache->shards[hash % CACHE_SHARDS];
+	node_t *node;
+
+	shard_wrlock(shard);
+	if ((node = shard_find(shard, uri, hash)))
+		node->expires = expires;
+	shard_unlock(shard);
+}
+
+/*
+ * Sums the charged size, object count and evictions of the shards
+ * without their locks; the totals may be a moment out of date
+ */
+void cache_usage(cache_t *cache, long *size, long *cnt, unsigned long *evictions)
+{
+	shard_t *shard;
+	int i;
+
+	*size = *cnt = *evictions = 0;
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		shard = &cache->shards[i];
+		*size += __atomic_load_n(&shard->size, __ATOMIC_RELAXED);
+		*cnt += __atomic_load_n(&shard->cnt, __ATOMIC_RELAXED);
+		*evictions += __atomic_load_n(&shard->evictions, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Writes every cached object with its URI, expiry, segment and LRU
+ * position to path, through a temporary file so that a crash leaves the
+ * old snapshot intact. Each shard is held still only while it is being written.
+ */
+int cache_save(cache_t *cache, char *path)
+{
+	char tmp[MAXLINE];
+	unsigned int hdr[2] = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION };
+	shard_t *shard;
+	FILE *fp;
+	int i, rc = 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (!(fp = fopen(tmp, "w")))
+		return -1;
+
+	if (fwrite(hdr, sizeof(hdr), 1, fp) != 1)
+		rc = -1;
+
+	for (i = 0; i < CACHE_SHARDS && !rc; i++) {
+		shard = &cache->shards[i];
+		shard_rdlock(shard);
+		shard_lru_lock(shard);
+		if (cache_save_lru(fp, &shard->protected) < 0
+		    || cache_save_lru(fp, &shard->probation) < 0)
+			rc = -1;
+		shard_lru_unlock(shard);
+		shard_unlock(shard);
+	}
+
+	if (fclose(fp) || rc < 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Maps a snapshot written by cache_save and links its objects in place,
+ * so that they are served without being copied. The mapping is private
+ * and lives as long as the process. Must run before the cache is shared,
+ * by threads or by worker processes, which inherit the mapping.
+ * Returns the number of objects restored, or -1 if the file is missing
+ * or not a snapshot.
+ */
+int cache_load(cache_t *cache, char *path)
+{
+	struct stat st;
+	unsigned int *hdr;
+	unsigned long hash;
+	snaprec_t *rec;
+	shard_t *shard;
+	node_t *node;
+	obj_t *obj;
+	char *base, *uri;
+	size_t off;
+	int fd, n = 0;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < 2 * sizeof(unsigned int)
+	    || (base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		Close(fd);
+		return -1;
+	}
+	Close(fd);
+
+	hdr = (unsigned int *)base;
+	if (hdr[0] != SNAPSHOT_MAGIC || hdr[1] != SNAPSHOT_VERSION) {
+		Munmap(base, st.st_size);
+		return -1;
+	}
+
+	for (off = SNAP_ALIGN(2 * sizeof(unsigned int)); off + sizeof(snaprec_t) <= st.st_size; ) {
+		rec = (snaprec_t *)(base + off);
+		if (rec->magic != SNAPSHOT_MAGIC || rec->urilen <= 0 || rec->urilen > MAXURI
+		    || rec->size < 0 || rec->size > st.st_size)
+			break;
+
+		uri = (char *)(rec + 1);
+		obj = (obj_t *)(uri + rec->urilen);
+		off += sizeof(snaprec_t) + rec->urilen + sizeof(obj_t) + SNAP_ALIGN(rec->size);
+		if (off > st.st_size || !memchr(uri, '\0', rec->urilen) || obj->size != rec->size)
+			break;
+
+		/* A smaller -o than the snapshot was taken with only skips the object */
+		if (rec->size > cache->max_object)
+			continue;
+
+		obj->refcnt = 1;
+		obj->mapped = 1;
+		obj->shared = 0;
+		obj->len = obj->size;
+		obj->data = obj->bytes;
+		obj->chunks = NULL;
+
+		hash = fnv1a(uri);
+		shard = &cache->shards[hash % CACHE_SHARDS];
+		if (shard_find(shard, uri, hash))
+			continue;
+		if (!(node = node_new(shard->shm, uri, hash, obj, rec->expires)))
+			continue;
+		if (shard->size + node->charge > shard->capacity) {
+			mem_free(shard->shm, node);	/* the object stays in the mapping */
+			continue;
+		}
+		shard_restore(shard, node, rec->protected);
+		n++;
+	}
+
+	return n;
+}
@@ -2,43 +2,171 @@
 #define __CACHE_H__
 
 #include "csapp.h"
+#include "shm.h"
 
-/* Recommended max cache and object sizes */
+/* Recommended max cache and object sizes, the defaults of the flags */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* objects are kept in chunks of CHUNK_BLOCK bytes, headers included */
+#define CHUNK_BLOCK 16384
+#define CHUNK_DATA ((int)(CHUNK_BLOCK - SHM_HDRSIZE - sizeof(chunk_t)))
+
+/*
+ * heap chunks are carved out of slabs of SLAB_BYTES, aligned to their
+ * size so that a chunk finds its slab by its address
+ */
+#define SLAB_BYTES (1 << 20)
+#define SLAB_CHUNKS ((int)((SLAB_BYTES - sizeof(slab_t)) / (CHUNK_BLOCK - SHM_HDRSIZE)))
+
 /* max URI size */
 #define MAXURI 1024
 
+/* number of independently locked cache shards */
+#define CACHE_SHARDS 8
+
+/* largest block of a shared cache, which bounds its hash tables */
+#define CACHE_SHM_BLOCK (16 << 20)
+
+/* initial number of hash buckets per shard (power of two) */
+#define SHARD_BUCKETS 64
+
+/* replacement policies */
+#define CACHE_LRU 0		/* plain LRU */
+#define CACHE_TINYLFU 1		/* TinyLFU admission over a segmented LRU */
+
+/* count-min sketch of the access frequencies, one per shard */
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 1024	/* power of two */
+#define SKETCH_MAX 15
+#define SKETCH_SAMPLE (10 * SKETCH_WIDTH)	/* increments between agings */
+
+/* share of a shard the protected segment may occupy, in percent */
+#define PROTECTED_RATIO 80
+
+#define SNAPSHOT_MAGIC 0x50534e50	/* "PNSP" */
+#define SNAPSHOT_VERSION 3
+
 /********************
  * data structures
  ********************/
 
+typedef struct __chunk {
+	struct __chunk *next;
+	int len;		/* bytes used, CHUNK_DATA but in the last */
+	int own;		/* a trimmed last chunk, in a block of its own */
+	char data[];
+} chunk_t;
+
+/* heap chunks, SLAB_CHUNKS to a slab, given back once all are free */
+typedef struct __slab {
+	struct __slab *prev;	/* slabs with free chunks */
+	struct __slab *next;
+	chunk_t *free;
+	long nfree;
+	char chunks[];
+} slab_t;
+
+/* response being collected into chunks, up to max bytes */
 typedef struct {
 	int cnt;
-	char buf[MAX_OBJECT_SIZE];
+	int max;		/* 0 once the buffer failed */
+	shm_t *shm;		/* arena of the chunks, or NULL for the heap */
+	chunk_t *head;
+	chunk_t *tail;
 } buf_t;
 
+/*
+ * immutable cached object, freed when the last reference is released;
+ * the bytes are in chunks, or follow the object if they came in whole
+ */
+typedef struct {
+	int refcnt;
+	int size;
+	int mapped;		/* lives in a snapshot mapping, never freed */
+	int shared;		/* lives in the shared arena, chunks and all */
+	int len;		/* bytes at data: the first chunk, or all of them */
+	int pad;
+	char *data;
+	chunk_t *chunks;	/* the first is the one at data, or NULL */
+	char bytes[];
+} obj_t;
+
 typedef struct __node {
-	int bufsize;
-	char *uri;
-	char *node_buf;
+	unsigned long hash;
+	obj_t *obj;
+	time_t expires;		/* fresh until then */
+	long charge;		/* heap or arena bytes of the node and its object */
+	int protected;		/* segment of the segmented LRU */
+	struct __node *hnext;	/* hash chain */
+	struct __node *prev;	/* LRU list */
 	struct __node *next;
+	char uri[];
 } node_t;
 
 typedef struct {
+	long size;
+	node_t *head;		/* most recently used */
+	node_t *tail;		/* least recently used */
+} lru_t;
+
+typedef struct {
+	long size;		/* heap bytes of the nodes, objects and buckets */
+	long capacity;
+	int cnt;
+	int nbuckets;
+	int policy;
+	node_t **buckets;
+	lru_t probation;	/* the only list under CACHE_LRU */
+	lru_t protected;	/* entries hit at least once since admission */
+	unsigned char sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+	int additions;
+	unsigned long evictions;
+	shm_t *shm;		/* arena of a shared cache, or NULL */
+	pthread_rwlock_t lock;
+	pthread_mutex_t lru_lock;	/* LRU lists and sketch */
+	pthread_mutex_t xlock;	/* all of it, when shared by processes */
+} shard_t;
+
+/* snapshot entry, followed by the padded URI and the object */
+typedef struct {
+	unsigned int magic;
+	int protected;
+	int urilen;		/* including the NUL and padding */
 	int size;
-	node_t *head;
+	time_t expires;
+} snaprec_t;
+
+typedef struct __cache {
+	shard_t *shards;	/* CACHE_SHARDS of them */
+	shm_t *shm;		/* the arena they live in, if shared */
+	int max_object;		/* largest object cached */
+	struct __disk *disk;	/* second tier, or NULL */
 } cache_t;
 
 /* buf_t APIs */
+buf_t *buf_new(cache_t *cache);
+void buf_delete(buf_t *buf);
 void buf_clear(buf_t *buf);
 int buf_fill(buf_t *buf, void *usrbuf, size_t n);
 
+/* obj_t APIs */
+obj_t *obj_new(void *data, int size);
+void obj_release(obj_t *obj);
+int obj_iov(obj_t *obj, long *off, long *n, struct iovec *iov, int max);
+void obj_copy(obj_t *obj, char *dst);
+
 /* cache_t APIs */
-void cache_init(cache_t *cache);
-int cache_read(cache_t *cache, char *uri, buf_t *buf);
-void cache_write(cache_t *cache, char *uri, buf_t *buf);
+int cache_policy(char *name);
+long cache_parse_size(char *arg);
+void cache_init(cache_t *cache, int policy, long capacity, int max_object, int shared);
+void cache_deinit(cache_t *cache);
+obj_t *cache_read(cache_t *cache, char *uri, time_t *expires);
+void cache_write(cache_t *cache, char *uri, buf_t *buf, time_t expires);
+void cache_refresh(cache_t *cache, char *uri, time_t expires);
+void cache_usage(cache_t *cache, long *size, long *cnt, unsigned long *evictions);
+int cache_save(cache_t *cache, char *path);
+int cache_load(cache_t *cache, char *path);
 
 #endif /* __CACHE_H__ */
 
@@ -0,0 +1,235 @@
+/*
+ * cachesim.c - trace-driven simulator for the proxy cache policies
+ *
+ * cachesim replays URL logs against the cache of cache.c exactly as the
+ * proxy drives it: every request is looked up with cache_read, and a miss
+ * is fetched (here, made up of the logged number of bytes) and offered to
+ * cache_write. It reports the request and byte hit ratios of every
+ * replacement policy, or only of the one chosen with -p.
+ *
+ * A log line is either
+ *
+ *   <uri> [<bytes>]
+ *
+ * or a common log format line, whose quoted request line gives the URI
+ * and whose last field the size of the response. Lines without a size
+ * use the default of -s. Empty lines and lines starting with '#' are
+ * skipped. The cache and object sizes default to those of the proxy.
+ *
+ * usage: cachesim [-p lru|tinylfu] [-c <bytes>] [-o <bytes>] [-s <bytes>] logfile ...
+ */
+
+/**************************************************
+ * [2013-11706] Kang Injae,
+ * Dept. of Mechanical & Aerospace Engineering
+ **************************************************/
+
+#include <limits.h>
+
+#include "cache.h"
+
+#define DEF_OBJSIZE 8192
+
+/********************
+ * data structures
+ ********************/
+
+typedef struct {
+	char *uri;
+	int size;
+} req_t;
+
+typedef struct {
+	int nreqs;
+	int maxreqs;
+	req_t *reqs;
+} trace_t;
+
+static char *policies[] = { "lru", "tinylfu", NULL };
+
+/* contents of every fetched object; only their sizes matter */
+static char *body;
+
+static long capacity = MAX_CACHE_SIZE, max_object = MAX_OBJECT_SIZE;
+
+/* helper functions */
+static int read_log(trace_t *trace, char *filename, int defsize);
+static void trace_add(trace_t *trace, char *uri, int size);
+static void simulate(trace_t *trace, char *name);
+static void usage(char *prog);
+
+/* main routine */
+int main(int argc, char *argv[])
+{
+	trace_t trace = { 0, 0, NULL };
+	char *policy = NULL, **p;
+	int defsize = DEF_OBJSIZE, c, i;
+
+	while ((c = getopt(argc, argv, "p:c:o:s:h")) != -1) {
+		switch (c) {
+		case 'p':
+			if (cache_policy(optarg) < 0)
+				usage(argv[0]);
+			policy = optarg;
+			break;
+		case 'c':
+			if ((capacity = cache_parse_size(optarg)) < 0)
+				usage(argv[0]);
+			break;
+		case 'o':
+			if ((max_object = cache_parse_size(optarg)) < 0 || max_object > INT_MAX)
+				usage(argv[0]);
+			break;
+		case 's':
+			if ((defsize = atoi(optarg)) < 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind == argc)
+		usage(argv[0]);
+
+	for (i = optind; i < argc; i++)
+		if (read_log(&trace, argv[i], defsize) < 0)
+			exit(1);
+
+	if (!trace.nreqs) {
+		fprintf(stderr, "%s: no requests found\n", argv[0]);
+		exit(1);
+	}
+
+	body = Calloc(1, max_object);
+
+	printf("%d requests, cache %ld bytes in %d shards, objects up to %ld bytes\n\n",
+	       trace.nreqs, capacity, CACHE_SHARDS, max_object);
+	printf("%-10s %10s %10s %8s %10s\n",
+	       "policy", "requests", "hits", "hit%", "byte-hit%");
+
+	if (policy)
+		simulate(&trace, policy);
+	else
+		for (p = policies; *p; p++)
+			simulate(&trace, *p);
+
+	for (i = 0; i < trace.nreqs; i++)
+		free(trace.reqs[i].uri);
+	free(trace.reqs);
+	free(body);
+	return 0;
+}
+
+/********************
+ * Helper Functions
+ ********************/
+
+/*
+ * read_log - Append the requests of a URL log to the trace
+ */
+static int read_log(trace_t *trace, char *filename, int defsize)
+{
+	char line[MAXLINE], uri[MAXURI], *s, *last;
+	int size;
+	FILE *fp;
+
+	if (!(fp = fopen(filename, "r"))) {
+		perror(filename);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		size = defsize;
+
+		/* Common log format: ... "GET <uri> HTTP/1.x" <status> <bytes> */
+		if ((s = strchr(line, '"'))) {
+			if (sscanf(s + 1, "%*s %1023s", uri) != 1)
+				continue;
+			if ((last = strrchr(line, ' ')) && last > strrchr(line, '"'))
+				sscanf(last, "%d", &size);
+		}
+		else if (sscanf(line, "%1023s %d", uri, &size) < 1 || uri[0] == '#')
+			continue;
+
+		trace_add(trace, uri, size < 0 ? defsize : size);
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+/*
+ * trace_add - Append one request to the trace
+ */
+static void trace_add(trace_t *trace, char *uri, int size)
+{
+	req_t *req;
+
+	if (trace->nreqs == trace->maxreqs) {
+		trace->maxreqs = trace->maxreqs ? 2 * trace->maxreqs : 1024;
+		trace->reqs = Realloc(trace->reqs, trace->maxreqs * sizeof(req_t));
+	}
+
+	req = &trace->reqs[trace->nreqs++];
+	req->uri = Malloc(strlen(uri) + 1);
+	strcpy(req->uri, uri);
+	req->size = size;
+}
+
+/*
+ * simulate - Replay the trace against an empty cache and print the ratios
+ */
+static void simulate(trace_t *trace, char *name)
+{
+	static cache_t cache;
+	buf_t *buf;
+	unsigned long hits = 0;
+	double bytes = 0, hitbytes = 0;
+	req_t *req;
+	obj_t *obj;
+	int i;
+
+	cache_init(&cache, cache_policy(name), capacity, max_object, 0);
+	buf = buf_new(&cache);
+
+	for (i = 0; i < trace->nreqs; i++) {
+		req = &trace->reqs[i];
+		bytes += req->size;
+
+		if ((obj = cache_read(&cache, req->uri, NULL))) {
+			hits++;
+			hitbytes += obj->size;
+			obj_release(obj);
+			continue;
+		}
+
+		/* Objects too large for the cache are relayed, not cached */
+		if (req->size <= max_object) {
+			buf_fill(buf, body, req->size);
+			cache_write(&cache, req->uri, buf, 0);
+			buf_clear(buf);
+		}
+	}
+
+	buf_delete(buf);
+	cache_deinit(&cache);
+
+	printf("%-10s %10d %10lu %7.2f%% %9.2f%%\n", name, trace->nreqs, hits,
+	       100.0 * hits / trace->nreqs, bytes ? 100.0 * hitbytes / bytes : 0.0);
+}
+
+/*
+ * usage - Print the usage message and exit
+ */
+static void usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-p lru|tinylfu] [-c <bytes>] [-o <bytes>] [-s <bytes>] logfile ...\n", prog);
+	fprintf(stderr, "Options\n");
+	fprintf(stderr, "\t-p <policy>  Simulate only this policy (default all).\n");
+	fprintf(stderr, "\t-c <bytes>   Cache size, k, m or g suffixed (default %d).\n", MAX_CACHE_SIZE);
+	fprintf(stderr, "\t-o <bytes>   Largest object cached (default %d).\n", MAX_OBJECT_SIZE);
+	fprintf(stderr, "\t-s <bytes>   Size of requests logged without one (default %d).\n", DEF_OBJSIZE);
+	fprintf(stderr, "\t-h           Print this message.\n");
+	exit(1);
+}
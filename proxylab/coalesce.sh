@@ -0,0 +1,147 @@
+#!/bin/bash
+#
+# coalesce.sh - Fires a burst of concurrent requests for one cold URI
+#     at the proxy and checks that Tiny saw exactly one request for it,
+#     i.e. that the misses were coalesced behind a single fetch, and
+#     that every client got the whole file.
+#
+#     Only the threaded engine coalesces, and its flight table is per
+#     process, so run it without -e and -w. The waiters hold their
+#     threads, so keep nclients within the threads plus the queue (-t,
+#     -q); the proxy sheds the connections beyond that.
+#
+#     usage: ./coalesce.sh [nclients] [proxy options...]
+#     e.g.   ./coalesce.sh 200 -t 64 -q 256
+#
+
+NCLIENTS=${1:-64}
+shift
+PROXY_ARGS="$@"
+
+HOME_DIR=`pwd`
+COALESCE_DIR="./.coalesce"
+TIMEOUT=20
+MAX_RAND=63000
+PORT_START=1024
+PORT_MAX=65000
+
+FILE=godzilla.jpg
+
+#
+# free_port - returns an available unused TCP port
+#
+function free_port {
+    port=$((( RANDOM % ${MAX_RAND}) + ${PORT_START}))
+
+    while [ TRUE ]
+    do
+        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+            | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+            | grep -E "[0-9]+" | uniq | tr "\n" " "`
+
+        echo "${portsinuse}" | grep -wq "${port}"
+        if [ "$?" == "0" ]; then
+            if [ $port -eq ${PORT_MAX} ]
+            then
+                echo "-1"
+                return
+            fi
+            port=`expr ${port} + 1`
+        else
+            echo "${port}"
+            return
+        fi
+    done
+}
+
+#
+# wait_for_port_use - Spins until something listens on the given
+#     TCP port. Gives up after 5 seconds.
+#
+function wait_for_port_use {
+    for i in 1 2 3 4 5 6 7 8 9 10
+    do
+        netstat --numeric-ports --numeric-hosts -ltn \
+            | grep -q ":${1} " && return 0
+        sleep 0.5
+    done
+    return 1
+}
+
+if [ ! -x ./proxy ]
+then
+    echo "Error: ./proxy not found or not an executable file. Please rebuild your proxy."
+    exit 1
+fi
+
+killall -q proxy tiny 2> /dev/null
+rm -rf ${COALESCE_DIR}
+mkdir -p ${COALESCE_DIR}/www ${COALESCE_DIR}/out
+
+# Build a private Tiny from source so a stale ./tiny/tiny can't skew the run
+echo "Building tiny into ${COALESCE_DIR}"
+gcc -O2 -I ./tiny -o ${COALESCE_DIR}/tiny ./tiny/tiny.c ./tiny/csapp.c -lpthread
+if [ ! -x ${COALESCE_DIR}/tiny ]
+then
+    echo "Error: could not build tiny."
+    exit 1
+fi
+
+# Tiny serves a directory of its own and logs each request line it reads
+cp ./tiny/${FILE} ${COALESCE_DIR}/www/
+tiny_port=$(free_port)
+echo "Starting tiny on ${tiny_port}"
+cd ${COALESCE_DIR}/www
+stdbuf -oL ../tiny ${tiny_port} > ../tiny.log 2> /dev/null &
+tiny_pid=$!
+cd ${HOME_DIR}
+wait_for_port_use "${tiny_port}"
+
+proxy_port=$(free_port)
+echo "Starting proxy on ${proxy_port} ${PROXY_ARGS}"
+./proxy ${PROXY_ARGS} ${proxy_port} &> /dev/null &
+proxy_pid=$!
+wait_for_port_use "${proxy_port}"
+
+# One curl starts every transfer at once, so the misses overlap; each
+# connection closes after its transfer, so none holds a proxy thread
+echo "Fetching /${FILE} with ${NCLIENTS} concurrent clients"
+args=""
+for i in `seq 1 ${NCLIENTS}`
+do
+    args="${args} --output ${COALESCE_DIR}/out/${i} http://localhost:${tiny_port}/${FILE}"
+done
+curl --parallel --parallel-immediate --parallel-max ${NCLIENTS} --max-time ${TIMEOUT} \
+    --silent --header "Connection: close" --proxy http://localhost:${proxy_port} \
+    ${args} 2> /dev/null
+
+bad=0
+for i in `seq 1 ${NCLIENTS}`
+do
+    if ! cmp -s ${COALESCE_DIR}/out/${i} ./tiny/${FILE}
+    then
+        echo "Failure: client ${i} got a bad ${FILE}"
+        bad=`expr ${bad} + 1`
+    fi
+done
+
+alive=1
+kill -0 ${proxy_pid} 2> /dev/null || alive=0
+
+kill ${proxy_pid} ${tiny_pid} 2> /dev/null
+wait 2> /dev/null
+fetches=`grep -c "^GET /${FILE} " ${COALESCE_DIR}/tiny.log`
+rm -rf ${COALESCE_DIR}
+
+echo "clients=${NCLIENTS} bad=${bad} origin_requests=${fetches}"
+if [ ${alive} -eq 0 ]
+then
+    echo "Failure: the proxy died under load"
+    exit 1
+fi
+if [ ${fetches} -ne 1 ]
+then
+    echo "Failure: tiny saw ${fetches} requests for /${FILE}, not 1"
+    exit 1
+fi
+[ ${bad} -eq 0 ]
@@ -0,0 +1,318 @@
+#include "disk.h"
+#include "hash.h"
+
+/* Records are 8-byte aligned */
+#define RECORD_SIZE(urilen, size) \
+	((int)((sizeof(record_t) + (urilen) + (size) + 7) & ~7UL))
+#define RECORD_AT(seg, off) ((record_t *)((seg)->base + (off)))
+
+static void *disk_compactor(void *vargp);
+
+/*
+ * Objects evicted from the memory cache are appended to one segment file
+ * at a time, and an in-memory index maps every URI to its latest record.
+ * Records are never updated in place; a record is dead once the index no
+ * longer points to it. When free segments run low the compactor thread
+ * copies the live records of the emptiest segment to the active one and
+ * frees it, or drops it whole if its live records would not fit, which
+ * ages out the least useful data first.
+ *
+ * The index is rebuilt from the segment files at startup, so the tier
+ * survives restarts. Readers hold the lock shared while they copy an
+ * object out of the mapping; appends and the compactor hold it
+ * exclusively.
+ */
+
+/*************************
+ * disk_t static methods
+ *************************/
+
+static dentry_t **disk_find(disk_t *disk, char *uri, unsigned long hash)
+{
+	dentry_t **link;
+
+	for (link = &disk->buckets[hash % DISK_BUCKETS]; *link; link = &(*link)->next)
+		if ((*link)->hash == hash && !strcmp((*link)->uri, uri))
+			break;
+
+	return link;
+}
+
+static void disk_unindex(disk_t *disk, dentry_t **link)
+{
+	dentry_t *dentry = *link;
+
+	disk->segs[dentry->seg].live -= RECORD_SIZE(strlen(dentry->uri) + 1, dentry->size);
+	*link = dentry->next;
+	free(dentry->uri);
+	free(dentry);
+}
+
+/* Points the index at a record unless a newer one is indexed already */
+static void disk_index(disk_t *disk, int seg, int off)
+{
+	record_t *rec = RECORD_AT(&disk->segs[seg], off);
+	char *uri = (char *)(rec + 1);
+	unsigned long hash = fnv1a(uri);
+	dentry_t **link = disk_find(disk, uri, hash), *dentry;
+
+	if ((dentry = *link)) {
+		if (dentry->seq > rec->seq)
+			return;
+		disk->segs[dentry->seg].live -= RECORD_SIZE(rec->urilen, dentry->size);
+	}
+	else {
+		dentry = Malloc(sizeof(dentry_t));
+		dentry->hash = hash;
+		dentry->uri = strdup(uri);
+		dentry->next = NULL;
+		*link = dentry;
+	}
+
+	dentry->seg = seg;
+	dentry->off = off;
+	dentry->size = rec->size;
+	dentry->seq = rec->seq;
+	dentry->expires = rec->expires;
+	disk->segs[seg].live += RECORD_SIZE(rec->urilen, rec->size);
+}
+
+static int disk_free_segments(disk_t *disk)
+{
+	int i, n = 0;
+
+	for (i = 0; i < DISK_SEGMENTS; i++)
+		if (i != disk->active && !disk->segs[i].end)
+			n++;
+
+	return n;
+}
+
+/* Does the record hold exactly the bytes of the object */
+static int disk_same(record_t *rec, obj_t *obj)
+{
+	char *p = (char *)(rec + 1) + rec->urilen;
+	chunk_t *chunk;
+
+	if (rec->size != obj->size || memcmp(p, obj->data, obj->len))
+		return 0;
+	p += obj->len;
+	for (chunk = obj->chunks ? obj->chunks->next : NULL; chunk; chunk = chunk->next) {
+		if (memcmp(p, chunk->data, chunk->len))
+			return 0;
+		p += chunk->len;
+	}
+	return 1;
+}
+
+/* Appends a record to the active segment; -1 if no segment has room */
+static int disk_append(disk_t *disk, char *uri, obj_t *obj, time_t expires)
+{
+	int urilen = strlen(uri) + 1, size = obj->size, len = RECORD_SIZE(urilen, size), i;
+	segment_t *seg = &disk->segs[disk->active];
+	record_t *rec;
+
+	if (seg->end + len > DISK_SEGMENT_SIZE) {
+		for (i = 0; i < DISK_SEGMENTS; i++)
+			if (i != disk->active && !disk->segs[i].end)
+				break;
+		if (i == DISK_SEGMENTS || len > DISK_SEGMENT_SIZE)
+			return -1;
+		seg = &disk->segs[disk->active = i];
+	}
+
+	/* The magic goes last so that a torn record ends the scan */
+	rec = RECORD_AT(seg, seg->end);
+	memcpy(rec + 1, uri, urilen);
+	obj_copy(obj, (char *)(rec + 1) + urilen);
+	rec->urilen = urilen;
+	rec->size = size;
+	rec->pad = 0;
+	rec->seq = disk->seq++;
+	rec->expires = expires;
+	rec->magic = DISK_MAGIC;
+
+	disk_index(disk, disk->active, seg->end);
+	seg->end += len;
+
+	/* Stale records of an earlier use of the segment follow */
+	if (seg->end + sizeof(record_t) <= DISK_SEGMENT_SIZE)
+		RECORD_AT(seg, seg->end)->magic = 0;
+
+	if (disk_free_segments(disk) < DISK_RESERVE)
+		V(&disk->compact);
+	return 0;
+}
+
+/* Indexes the valid records of a segment file */
+static void disk_scan(disk_t *disk, int i)
+{
+	segment_t *seg = &disk->segs[i];
+	record_t *rec;
+	int off = 0, len;
+
+	while (off + sizeof(record_t) <= DISK_SEGMENT_SIZE) {
+		rec = RECORD_AT(seg, off);
+		if (rec->magic != DISK_MAGIC || !rec->urilen || rec->urilen > MAXURI
+		    || rec->size > DISK_SEGMENT_SIZE)
+			break;
+		len = RECORD_SIZE(rec->urilen, rec->size);
+		if (len < 0 || off + len > DISK_SEGMENT_SIZE
+		    || ((char *)(rec + 1))[rec->urilen - 1])
+			break;
+
+		if (rec->seq >= disk->seq)
+			disk->seq = rec->seq + 1;
+		disk_index(disk, i, off);
+		off += len;
+	}
+
+	seg->end = off;
+}
+
+/* Empties segment i, moving its live records if they fit */
+static void disk_compact(disk_t *disk, int i)
+{
+	segment_t *seg = &disk->segs[i], *active;
+	dentry_t **link;
+	record_t *rec;
+	obj_t view;
+	char *uri;
+	int off, keep;
+
+	pthread_rwlock_wrlock(&disk->lock);
+	active = &disk->segs[disk->active];
+	keep = seg->live <= DISK_SEGMENT_SIZE - active->end;
+	pthread_rwlock_unlock(&disk->lock);
+
+	/* One record at a time, so that readers are held up only briefly */
+	for (off = 0; off < seg->end; off += RECORD_SIZE(rec->urilen, rec->size)) {
+		rec = RECORD_AT(seg, off);
+		uri = (char *)(rec + 1);
+
+		/* The record seen as an object in one piece */
+		view.size = view.len = rec->size;
+		view.data = uri + rec->urilen;
+		view.chunks = NULL;
+
+		pthread_rwlock_wrlock(&disk->lock);
+		link = disk_find(disk, uri, fnv1a(uri));
+		if (*link && (*link)->seg == i && (*link)->off == off)
+			if (!keep || disk_append(disk, uri, &view, rec->expires) < 0)
+				disk_unindex(disk, link);
+		pthread_rwlock_unlock(&disk->lock);
+	}
+
+	pthread_rwlock_wrlock(&disk->lock);
+	seg->end = 0;
+	RECORD_AT(seg, 0)->magic = 0;
+	pthread_rwlock_unlock(&disk->lock);
+}
+
+/* compactor thread */
+static void *disk_compactor(void *vargp)
+{
+	disk_t *disk = vargp;
+	int i, victim;
+
+	Pthread_detach(Pthread_self());
+
+	while (1) {
+		P(&disk->compact);
+
+		while (1) {
+			/* The emptiest segment in use is the cheapest to free */
+			pthread_rwlock_rdlock(&disk->lock);
+			victim = -1;
+			if (disk_free_segments(disk) < DISK_RESERVE)
+				for (i = 0; i < DISK_SEGMENTS; i++)
+					if (i != disk->active && disk->segs[i].end
+					    && (victim < 0 || disk->segs[i].live < disk->segs[victim].live))
+						victim = i;
+			pthread_rwlock_unlock(&disk->lock);
+
+			if (victim < 0)
+				break;
+			disk_compact(disk, victim);
+		}
+	}
+
+	return NULL;
+}
+
+/********************
+ * disk_t APIs
+ ********************/
+
+/* Maps the segment files under dir, creating them if needed */
+disk_t *disk_open(char *dir)
+{
+	disk_t *disk = Calloc(1, sizeof(disk_t));
+	char path[MAXLINE];
+	segment_t *seg;
+	pthread_t tid;
+	int i;
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		unix_error("mkdir error");
+
+	for (i = 0; i < DISK_SEGMENTS; i++) {
+		seg = &disk->segs[i];
+		snprintf(path, sizeof(path), "%s/seg.%02d", dir, i);
+		seg->fd = Open(path, O_RDWR | O_CREAT, 0644);
+		if (ftruncate(seg->fd, DISK_SEGMENT_SIZE) < 0)
+			unix_error("ftruncate error");
+		seg->base = Mmap(NULL, DISK_SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, seg->fd, 0);
+	}
+
+	for (i = 0; i < DISK_SEGMENTS; i++)
+		disk_scan(disk, i);
+
+	/* Resume appending to the least filled segment */
+	for (i = 1; i < DISK_SEGMENTS; i++)
+		if (disk->segs[i].end < disk->segs[disk->active].end)
+			disk->active = i;
+
+	pthread_rwlock_init(&disk->lock, NULL);
+	Sem_init(&disk->compact, 0, 0);
+	Pthread_create(&tid, NULL, disk_compactor, disk);
+
+	if (disk_free_segments(disk) < DISK_RESERVE)
+		V(&disk->compact);
+	return disk;
+}
+
+/* Returns a private copy of the object and its expiry, or NULL */
+obj_t *disk_get(disk_t *disk, char *uri, time_t *expires)
+{
+	dentry_t *dentry;
+	record_t *rec;
+	obj_t *obj = NULL;
+
+	pthread_rwlock_rdlock(&disk->lock);
+	if ((dentry = *disk_find(disk, uri, fnv1a(uri)))) {
+		rec = RECORD_AT(&disk->segs[dentry->seg], dentry->off);
+		obj = obj_new((char *)(rec + 1) + rec->urilen, rec->size);
+		*expires = dentry->expires;
+	}
+	pthread_rwlock_unlock(&disk->lock);
+
+	return obj;
+}
+
+/*
+ * Objects are immutable, so a URI already on disk is rewritten only if
+ * a new version or a revalidation changed its bytes or its expiry
+ */
+void disk_put(disk_t *disk, char *uri, obj_t *obj, time_t expires)
+{
+	dentry_t *dentry;
+
+	pthread_rwlock_wrlock(&disk->lock);
+	dentry = *disk_find(disk, uri, fnv1a(uri));
+	if (!dentry || dentry->expires != expires ||
+	    !disk_same(RECORD_AT(&disk->segs[dentry->seg], dentry->off), obj))
+		disk_append(disk, uri, obj, expires);
+	pthread_rwlock_unlock(&disk->lock);
+}
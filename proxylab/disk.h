@@ -0,0 +1,67 @@
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* segment files and their size; the tier holds up to their product */
+#define DISK_SEGMENTS 16
+#define DISK_SEGMENT_SIZE (8 << 20)
+
+/* free segments kept in reserve by the compactor */
+#define DISK_RESERVE 2
+
+/* number of hash buckets of the index */
+#define DISK_BUCKETS 4096
+
+#define DISK_MAGIC 0x32434143	/* "CAC2" */
+
+/********************
+ * data structures
+ ********************/
+
+/* on-disk record, followed by the URI and the object bytes */
+typedef struct {
+	unsigned int magic;
+	unsigned int urilen;	/* including the NUL */
+	unsigned int size;
+	unsigned int pad;
+	unsigned long seq;	/* newer records supersede older ones */
+	time_t expires;
+} record_t;
+
+/* index entry of a live record */
+typedef struct __dentry {
+	unsigned long hash;
+	char *uri;
+	int seg;
+	int off;
+	int size;
+	unsigned long seq;
+	time_t expires;
+	struct __dentry *next;
+} dentry_t;
+
+/* append-only memory-mapped segment file */
+typedef struct {
+	int fd;
+	char *base;
+	int end;		/* append offset */
+	int live;		/* bytes of records still indexed */
+} segment_t;
+
+typedef struct __disk {
+	segment_t segs[DISK_SEGMENTS];
+	int active;		/* segment being appended to */
+	unsigned long seq;
+	dentry_t *buckets[DISK_BUCKETS];
+	pthread_rwlock_t lock;
+	sem_t compact;		/* wakes up the compactor */
+} disk_t;
+
+/* disk_t APIs */
+disk_t *disk_open(char *dir);
+obj_t *disk_get(disk_t *disk, char *uri, time_t *expires);
+void disk_put(disk_t *disk, char *uri, obj_t *obj, time_t expires);
+
+#endif /* __DISK_H__ */
@@ -0,0 +1,194 @@
+#include <stddef.h>
+
+#include "dns.h"
+#include "hash.h"
+
+/*
+ * getaddrinfo is slow and, in glibc, takes locks of its own, so resolving
+ * the origin of every request serializes the workers behind the resolver.
+ * The cache keeps each host:port in one of DNS_WAYS slots of a fixed set,
+ * overwriting the key that expires first. A slot is a seqlock: lookups
+ * copy it out without taking any lock and retry if a writer bumped the
+ * sequence meanwhile, while writers, which run only after a miss, take
+ * the mutex among themselves. Resolution itself happens outside of any
+ * lock; concurrent misses of one key resolve it twice, which is harmless.
+ *
+ * Failures that are answers (no such host) are cached for a short time
+ * as well; transient ones are not.
+ */
+
+/*************************
+ * dns_t static methods
+ *************************/
+
+/* The first slot of the set of a key, by its FNV-1a hash */
+static dnsent_t *dns_set(dns_t *dns, char *key)
+{
+	return &dns->slots[fnv1a(key) % (DNS_SLOTS / DNS_WAYS) * DNS_WAYS];
+}
+
+/* Copies a slot out consistently */
+static void dns_copy(dnsent_t *slot, dnsent_t *ent)
+{
+	unsigned int seq;
+
+	do {
+		while ((seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		memcpy(ent, slot, sizeof(dnsent_t));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq);
+}
+
+/* Copies the live resolution of key out; 0 if the cache has none */
+static int dns_read(dns_t *dns, char *key, dnsent_t *ent)
+{
+	dnsent_t *set = dns_set(dns, key);
+	int i;
+
+	for (i = 0; i < DNS_WAYS; i++) {
+		dns_copy(&set[i], ent);
+		if (!strcmp(ent->key, key))
+			return ent->expires > time(NULL);
+	}
+
+	return 0;
+}
+
+/* Publishes a resolution over the slot of its key or the oldest one */
+static void dns_write(dns_t *dns, dnsent_t *ent)
+{
+	dnsent_t *set = dns_set(dns, ent->key), *slot = set;
+	unsigned int seq;
+	int i;
+
+	pthread_mutex_lock(&dns->lock);
+	for (i = 0; i < DNS_WAYS; i++) {
+		if (!strcmp(set[i].key, ent->key)) {
+			slot = &set[i];
+			break;
+		}
+		if (set[i].expires < slot->expires)
+			slot = &set[i];
+	}
+
+	seq = slot->seq;
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(slot->key, ent->key, sizeof(dnsent_t) - offsetof(dnsent_t, key));
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dns->lock);
+}
+
+/* the default resolver */
+static int dns_getaddrinfo(char *host, char *port, dnsent_t *ent)
+{
+	struct addrinfo hints, *listp, *p;
+	dnsaddr_t *addr;
+	int rc;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+	if ((rc = getaddrinfo(host, port, &hints, &listp)))
+		return ent->error = rc;
+
+	for (p = listp; p && ent->naddrs < DNS_MAX_ADDRS; p = p->ai_next) {
+		if (p->ai_addrlen > sizeof(struct sockaddr_storage))
+			continue;
+		addr = &ent->addrs[ent->naddrs++];
+		addr->family = p->ai_family;
+		addr->socktype = p->ai_socktype;
+		addr->protocol = p->ai_protocol;
+		addr->addrlen = p->ai_addrlen;
+		memcpy(&addr->addr, p->ai_addr, p->ai_addrlen);
+	}
+	freeaddrinfo(listp);
+
+	return 0;
+}
+
+/********************
+ * dns_t APIs
+ ********************/
+
+/* resolve may stand in for getaddrinfo; NULL selects it */
+void dns_init(dns_t *dns, dns_resolver_t resolve)
+{
+	pthread_mutex_init(&dns->lock, NULL);
+	dns->resolve = resolve ? resolve : dns_getaddrinfo;
+	memset(dns->slots, 0, sizeof(dns->slots));
+}
+
+/*
+ * Resolves host:port into *ent, from the cache while the resolution is
+ * fresh. Returns 0, or the getaddrinfo error code of a failure.
+ */
+int dns_lookup(dns_t *dns, char *host, char *port, dnsent_t *ent)
+{
+	char key[DNS_KEYLEN];
+	int rc, cached;
+
+	cached = snprintf(key, DNS_KEYLEN, "%s:%s", host, port) < DNS_KEYLEN;
+	if (cached && dns_read(dns, key, ent))
+		return ent->error;
+
+	memset(ent, 0, sizeof(dnsent_t));
+	strcpy(ent->key, key);
+	rc = dns->resolve(host, port, ent);
+	ent->error = rc;
+
+	/* A negative answer is final for a while; a transient error is not */
+	if (!rc)
+		ent->expires = time(NULL) + DNS_TTL;
+	else if (rc != EAI_AGAIN && rc != EAI_SYSTEM && rc != EAI_MEMORY)
+		ent->expires = time(NULL) + DNS_NEGATIVE_TTL;
+	else
+		cached = 0;
+
+	if (cached)
+		dns_write(dns, ent);
+	return rc;
+}
+
+/* Forgets the resolution of host:port, e.g. when none of it answers */
+void dns_invalidate(dns_t *dns, char *host, char *port)
+{
+	dnsent_t ent;
+
+	if (snprintf(ent.key, DNS_KEYLEN, "%s:%s", host, port) >= DNS_KEYLEN)
+		return;
+	if (dns_read(dns, ent.key, &ent)) {
+		ent.expires = 0;
+		dns_write(dns, &ent);
+	}
+}
+
+/*
+ * open_clientfd over the cache: returns a connected descriptor, -2 if
+ * host:port does not resolve, or -1 with errno set if no address answers
+ */
+int dns_connect(dns_t *dns, char *host, char *port)
+{
+	dnsent_t ent;
+	dnsaddr_t *addr;
+	int fd, i, rc;
+
+	if ((rc = dns_lookup(dns, host, port, &ent))) {
+		fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", host, port, gai_strerror(rc));
+		return -2;
+	}
+
+	for (i = 0; i < ent.naddrs; i++) {
+		addr = &ent.addrs[i];
+		if ((fd = socket(addr->family, addr->socktype, addr->protocol)) < 0)
+			continue;
+		if (connect(fd, (SA *)&addr->addr, addr->addrlen) != -1)
+			return fd;
+		close(fd);
+	}
+
+	/* The addresses may have moved */
+	dns_invalidate(dns, host, port);
+	return -1;
+}
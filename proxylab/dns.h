@@ -0,0 +1,59 @@
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+
+/* number of cache slots, and of the slots a host:port key may take */
+#define DNS_SLOTS 256
+#define DNS_WAYS 2
+
+/* longest host:port key, and the addresses kept per key */
+#define DNS_KEYLEN 264
+#define DNS_MAX_ADDRS 4
+
+/* seconds a resolution is reused, and a failed one; tests shorten them */
+#ifndef DNS_TTL
+#define DNS_TTL 60
+#endif
+#ifndef DNS_NEGATIVE_TTL
+#define DNS_NEGATIVE_TTL 5
+#endif
+
+/********************
+ * data structures
+ ********************/
+
+typedef struct {
+	int family;
+	int socktype;
+	int protocol;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+} dnsaddr_t;
+
+/* resolution of a host:port key */
+typedef struct {
+	unsigned int seq;	/* odd while the slot is rewritten */
+	char key[DNS_KEYLEN];
+	time_t expires;
+	int error;		/* getaddrinfo error of a negative entry */
+	int naddrs;
+	dnsaddr_t addrs[DNS_MAX_ADDRS];
+} dnsent_t;
+
+/* fills in the error or the addresses of ent; getaddrinfo by default */
+typedef int (*dns_resolver_t)(char *host, char *port, dnsent_t *ent);
+
+typedef struct {
+	pthread_mutex_t lock;	/* serializes writers */
+	dns_resolver_t resolve;
+	dnsent_t slots[DNS_SLOTS];
+} dns_t;
+
+/* dns_t APIs */
+void dns_init(dns_t *dns, dns_resolver_t resolve);
+int dns_lookup(dns_t *dns, char *host, char *port, dnsent_t *ent);
+void dns_invalidate(dns_t *dns, char *host, char *port);
+int dns_connect(dns_t *dns, char *host, char *port);
+
+#endif /* __DNS_H__ */
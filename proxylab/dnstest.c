@@ -0,0 +1,232 @@
+/*
+ * dnstest.c - checks of the resolver cache of dns.c
+ *
+ * The cache is given a stand-in resolver that answers from a small
+ * hosts table and counts its calls, so every check knows exactly when
+ * the cache went to the resolver. dns.c is built in with TTLs of one
+ * second to let expiry be watched without long waits.
+ *
+ * The last check has reader threads copy resolutions out while a writer
+ * keeps replacing them. Every answer of the stand-in carries a
+ * generation in all of its addresses, so a copy torn by a writer shows
+ * up as addresses of different generations, or of another host.
+ *
+ * usage: dnstest [-t <readers>] [-s <seconds>]
+ */
+
+/**************************************************
+ * [2013-11706] Kang Injae,
+ * Dept. of Mechanical & Aerospace Engineering
+ **************************************************/
+
+#include "dns.h"
+
+#define DEF_READERS 4
+#define DEF_SECONDS 2
+
+/* hosts of the stand-in; the rest do not exist */
+static struct {
+	char *name;
+	unsigned int ip;
+} hosts[] = {
+	{ "alpha", 0x0a000001 },	/* 10.0.0.1 */
+	{ "beta", 0x0a000002 },
+	{ "gamma", 0x0a000003 },
+	{ "delta", 0x0a000004 },
+	{ NULL, 0 }
+};
+
+static int calls;		/* resolver calls */
+static int generation;		/* bumped by every answer */
+static volatile int stop;
+static int failures;
+
+static dns_t dns;
+
+/********************
+ * stand-in resolver
+ ********************/
+
+/*
+ * Answers DNS_MAX_ADDRS addresses of a known host, all with the IP of
+ * the table and the generation of the answer as their port; "flaky"
+ * fails transiently, anything else is not found
+ */
+static int fixture_resolve(char *host, char *port, dnsent_t *ent)
+{
+	struct sockaddr_in *sin;
+	int i, gen;
+
+	__atomic_add_fetch(&calls, 1, __ATOMIC_RELAXED);
+	if (!strcmp(host, "flaky"))
+		return EAI_AGAIN;
+
+	for (i = 0; hosts[i].name && strcmp(hosts[i].name, host); i++)
+		;
+	if (!hosts[i].name)
+		return EAI_NONAME;
+
+	gen = __atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+	for (ent->naddrs = 0; ent->naddrs < DNS_MAX_ADDRS; ent->naddrs++) {
+		sin = (struct sockaddr_in *)&ent->addrs[ent->naddrs].addr;
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(gen & 0xffff);
+		sin->sin_addr.s_addr = htonl(hosts[i].ip);
+		ent->addrs[ent->naddrs].family = AF_INET;
+		ent->addrs[ent->naddrs].socktype = SOCK_STREAM;
+		ent->addrs[ent->naddrs].addrlen = sizeof(struct sockaddr_in);
+	}
+	return 0;
+}
+
+/********************
+ * checks
+ ********************/
+
+static void check(int cond, char *what)
+{
+	printf("%s: %s\n", cond ? "ok" : "FAILED", what);
+	if (!cond)
+		failures++;
+}
+
+/* resolver calls a lookup took */
+static int lookup_calls(char *host, int *rc, dnsent_t *ent)
+{
+	int before = calls;
+
+	*rc = dns_lookup(&dns, host, "80", ent);
+	return calls - before;
+}
+
+/* is ent one whole answer of the stand-in for host */
+static int consistent(char *host, dnsent_t *ent)
+{
+	struct sockaddr_in *sin;
+	char key[DNS_KEYLEN];
+	int i, j;
+
+	for (j = 0; hosts[j].name && strcmp(hosts[j].name, host); j++)
+		;
+	sprintf(key, "%s:80", host);
+	if (strcmp(ent->key, key) || ent->naddrs != DNS_MAX_ADDRS)
+		return 0;
+	for (i = 0; i < ent->naddrs; i++) {
+		sin = (struct sockaddr_in *)&ent->addrs[i].addr;
+		if (sin->sin_addr.s_addr != htonl(hosts[j].ip) ||
+		    sin->sin_port != ((struct sockaddr_in *)&ent->addrs[0].addr)->sin_port)
+			return 0;
+	}
+	return 1;
+}
+
+static void check_ttl(void)
+{
+	dnsent_t ent;
+	int rc;
+
+	check(lookup_calls("alpha", &rc, &ent) == 1 && !rc && consistent("alpha", &ent),
+	      "a miss goes to the resolver");
+	check(lookup_calls("alpha", &rc, &ent) == 0 && !rc && consistent("alpha", &ent),
+	      "a fresh resolution is served from the cache");
+	check(lookup_calls("nowhere", &rc, &ent) == 1 && rc == EAI_NONAME,
+	      "an unknown host fails");
+	check(lookup_calls("nowhere", &rc, &ent) == 0 && rc == EAI_NONAME,
+	      "the failure is cached");
+	lookup_calls("flaky", &rc, &ent);
+	check(lookup_calls("flaky", &rc, &ent) == 1 && rc == EAI_AGAIN,
+	      "a transient failure is not cached");
+
+	dns_invalidate(&dns, "alpha", "80");
+	check(lookup_calls("alpha", &rc, &ent) == 1 && !rc,
+	      "an invalidated resolution is resolved again");
+
+	sleep(DNS_TTL + 1);
+	check(lookup_calls("alpha", &rc, &ent) == 1 && !rc,
+	      "a resolution expires after DNS_TTL");
+	check(lookup_calls("nowhere", &rc, &ent) == 1 && rc == EAI_NONAME,
+	      "a failure expires after DNS_NEGATIVE_TTL");
+}
+
+static void *reader(void *vargp)
+{
+	long torn = 0, reads = 0;
+	dnsent_t ent;
+	int i;
+
+	while (!stop) {
+		for (i = 0; hosts[i].name; i++, reads++)
+			if (dns_lookup(&dns, hosts[i].name, "80", &ent) ||
+			    !consistent(hosts[i].name, &ent))
+				torn++;
+	}
+	printf("  reader: %ld lookups, %ld inconsistent\n", reads, torn);
+	return (void *)torn;
+}
+
+static void *writer(void *vargp)
+{
+	dnsent_t ent;
+	long writes = 0;
+	int i;
+
+	while (!stop) {
+		for (i = 0; hosts[i].name; i++, writes++) {
+			dns_invalidate(&dns, hosts[i].name, "80");
+			dns_lookup(&dns, hosts[i].name, "80", &ent);
+		}
+	}
+	printf("  writer: %ld rewrites\n", writes);
+	return NULL;
+}
+
+static void check_readers(int nreaders, int seconds)
+{
+	pthread_t tids[nreaders + 1];
+	long torn = 0;
+	void *rc;
+	int i;
+
+	stop = 0;
+	Pthread_create(&tids[nreaders], NULL, writer, NULL);
+	for (i = 0; i < nreaders; i++)
+		Pthread_create(&tids[i], NULL, reader, NULL);
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i <= nreaders; i++) {
+		Pthread_join(tids[i], &rc);
+		torn += (long)rc;
+	}
+	check(!torn, "readers never see a torn resolution");
+}
+
+int main(int argc, char **argv)
+{
+	int c, nreaders = DEF_READERS, seconds = DEF_SECONDS;
+
+	while ((c = getopt(argc, argv, "t:s:")) != -1) {
+		switch (c) {
+		case 't':
+			nreaders = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || nreaders < 1 || seconds < 1)
+		goto usage;
+
+	dns_init(&dns, fixture_resolve);
+	check_ttl();
+	check_readers(nreaders, seconds);
+
+	printf("%s\n", failures ? "FAILED" : "all passed");
+	return failures ? 1 : 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-t <readers>] [-s <seconds>]\n", argv[0]);
+	exit(1);
+}
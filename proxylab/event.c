@@ -0,0 +1,546 @@
+/*
+ * event.c - epoll-driven proxy engine
+ *
+ * Every connection is a small state machine that only ever waits on one
+ * of its two descriptors, armed EPOLLONESHOT in the epoll instance of the
+ * loop that accepted it. A loop never blocks on a slow client or origin,
+ * so a handful of loops (one per core) can hold a great many connections.
+ * The engine talks to the same cache.c API as the threaded one.
+ */
+
+#include <sys/epoll.h>
+
+#include "event.h"
+#include "http.h"
+
+/* results of a state handler */
+#define CONN_CLOSE	-1	/* finished or failed */
+#define CONN_WAIT	0	/* waiting for an event */
+#define CONN_NEXT	1	/* moved to another state */
+
+static int listen_fd;
+
+static void *event_loop(void *vargp);
+static void event_accept(int efd);
+
+/*************************
+ * conn_t static methods
+ *************************/
+
+static conn_t *conn_new(int efd, int client_fd)
+{
+	conn_t *conn = Calloc(1, sizeof(conn_t));
+
+	conn->state = CLIENT_READ;
+	conn->efd = efd;
+	conn->client_fd = client_fd;
+	conn->server_fd = -1;
+	conn->len = -1;
+	stats_add(&stats, STATS_CONNECTIONS, 1);
+
+	return conn;
+}
+
+static void conn_close(conn_t *conn)
+{
+	/* Log the request, if one was read; an upstream answer has a status */
+	if (conn->rec.method[0]) {
+		if (conn->stat_code) {
+			conn->rec.status = conn->stat_code;
+			conn->rec.bytes = conn->sum;
+		}
+		stats_request(&stats, &conn->rec);
+		alog_end(&access_log, &conn->rec);
+	}
+	stats_add(&stats, STATS_CONNECTIONS, -1);
+
+	/* Closing a descriptor also drops it from the epoll instance */
+	close(conn->client_fd);
+	if (conn->server_fd >= 0)
+		close(conn->server_fd);
+
+	if (conn->obj)
+		obj_release(conn->obj);
+	free(conn->out);
+	buf_delete(conn->cache_buf);
+	free(conn);
+}
+
+/* Wait for events on one descriptor of the connection */
+static int conn_arm(conn_t *conn, int fd, int events)
+{
+	struct epoll_event ev;
+
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = conn;
+	if (epoll_ctl(conn->efd, EPOLL_CTL_MOD, fd, &ev) < 0)
+		return CONN_CLOSE;
+	return CONN_WAIT;
+}
+
+static int conn_connect(conn_t *conn, char *host, char *port)
+{
+	struct epoll_event ev;
+	dnsent_t ent;
+	dnsaddr_t *addr;
+	int fd = -1, i;
+
+	if (dns_lookup(&resolver, host, port, &ent))
+		return -1;
+
+	for (i = 0; i < ent.naddrs; i++) {
+		addr = &ent.addrs[i];
+		if ((fd = socket(addr->family, addr->socktype | SOCK_NONBLOCK,
+				 addr->protocol)) < 0)
+			continue;
+		if (!connect(fd, (SA *)&addr->addr, addr->addrlen) || errno == EINPROGRESS)
+			break;
+		close(fd);
+		fd = -1;
+	}
+
+	if (fd < 0) {
+		dns_invalidate(&resolver, host, port);
+		return -1;
+	}
+
+	conn->server_fd = fd;
+	ev.events = EPOLLOUT | EPOLLONESHOT;
+	ev.data.ptr = conn;
+	return epoll_ctl(conn->efd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* Reply without going upstream */
+static int conn_reply(conn_t *conn, char *msg)
+{
+	conn->out = Malloc(MAXLINE);
+	snprintf(conn->out, MAXLINE, "%s", msg);
+	conn->wptr = conn->out;
+	conn->wlen = strlen(conn->out);
+	conn->done = 1;
+	conn->state = CLIENT_WRITE;
+	return CONN_NEXT;
+}
+
+/* Scan the response headers for the status, length and caching directives */
+static void conn_parse_response(conn_t *conn)
+{
+	char *line, *eol, buf[MAXLINE];
+
+	sscanf(conn->hdr, "%*s %d", &conn->stat_code);
+	http_fresh_init(&conn->fresh);
+	for (line = strstr(conn->hdr, "\r\n"); line; line = eol) {
+		line += 2;
+		if (!(eol = strstr(line, "\r\n")))
+			break;
+		if (!strncasecmp(line, "Content-Length:", 15))
+			conn->len = atol(line + 15);
+		else if (eol - line < MAXLINE) {
+			memcpy(buf, line, eol - line);
+			buf[eol - line] = '\0';
+			http_fresh_header(&conn->fresh, buf);
+		}
+	}
+}
+
+/*
+ * Put the response headers up to end, without the hop-by-hop ones, in
+ * front of the body bytes at off of the relay buffer, and announce that
+ * the connection closes after the body
+ */
+static void conn_client_head(conn_t *conn, char *end, int off, int body)
+{
+	char head[MAXBUF + 32], *line, *next;
+	int len = 0;
+
+	for (line = conn->hdr; line < end; line = next) {
+		next = strstr(line, "\r\n") + 2;
+		if (!http_hop_header(line)) {
+			memcpy(head + len, line, next - line);
+			len += next - line;
+		}
+	}
+	len += sprintf(head + len, "Connection: close\r\n\r\n");
+
+	memmove(conn->out + len, conn->out + off, body);
+	memcpy(conn->out, head, len);
+	conn->wlen = len + body;
+}
+
+#ifdef CACHE_ENABLED
+/* Cache the response headers up to end, leaving out the hop-by-hop ones */
+static void conn_cache_headers(conn_t *conn, char *end)
+{
+	char *line, *next;
+
+	for (line = conn->hdr; line < end; line = next) {
+		next = strstr(line, "\r\n") + 2;
+		if (!http_hop_header(line) &&
+		    buf_fill(conn->cache_buf, line, next - line) < 0)
+			conn->cache_buf_failed = 1;
+	}
+
+	if (buf_fill(conn->cache_buf, "\r\n", 2) < 0)
+		conn->cache_buf_failed = 1;
+}
+#endif
+
+/*************************
+ * state handlers
+ *************************/
+
+static int do_client_read(conn_t *conn)
+{
+	char *host, *port;
+	request_t rq;
+	header_t *h;
+	ssize_t n;
+	int len, head, json, i;
+#ifdef CACHE_ENABLED
+	time_t expires;
+	int hlen;
+#endif
+
+	/* Read until the request head parses whole */
+	while (!(head = http_parse_request(conn->hdr, conn->hdrlen, &rq))) {
+		if (conn->hdrlen == MAXBUF - 1)
+			return CONN_CLOSE;
+		n = read(conn->client_fd, conn->hdr + conn->hdrlen,
+			 MAXBUF - 1 - conn->hdrlen);
+		if (n < 0 && errno == EAGAIN)
+			return conn_arm(conn, conn->client_fd, EPOLLIN);
+		if (n <= 0)
+			return CONN_CLOSE;
+		conn->hdrlen += n;
+		conn->hdr[conn->hdrlen] = '\0';
+	}
+
+	if (head < 0 || rq.uri.len >= MAXURI)
+		return CONN_CLOSE;
+	memcpy(conn->uri, rq.uri.ptr, rq.uri.len);
+	conn->uri[rq.uri.len] = '\0';
+	alog_begin(&conn->rec, rq.method.ptr, rq.method.len, rq.uri.ptr, rq.uri.len);
+
+	/* The proxy answers for itself at STATS_PATH */
+	if (!rq.host.len && (json = stats_match(rq.uri.ptr, rq.uri.len)) >= 0) {
+		conn->out = Malloc(MAXBUF);
+		if ((len = stats_response(&stats, json, 0, conn->out, MAXBUF)) < 0)
+			return CONN_CLOSE;
+		conn->rec.status = 200;
+		conn->wptr = conn->out;
+		conn->wlen = len;
+		conn->done = 1;
+		conn->state = CLIENT_WRITE;
+		return CONN_NEXT;
+	}
+
+#ifdef CACHE_ENABLED
+	/* Send a fresh or a refreshing stale object straight from the cache */
+	if ((conn->obj = cache_read(&cache, conn->uri, &expires)) && expires <= time(NULL) &&
+	    !refresh_stale(conn->uri, expires)) {
+		obj_release(conn->obj);
+		conn->obj = NULL;
+	}
+	if (conn->obj) {
+		conn->rec.cache = expires <= time(NULL) ? ALOG_STALE : ALOG_HIT;
+		conn->rec.status = 200;
+		hlen = http_header_size(conn->obj->data, conn->obj->len);
+		conn->rec.bytes = hlen < 0 ? conn->obj->size : conn->obj->size - hlen - 2;
+		conn->wptr = conn->obj->data;
+		conn->wlen = conn->obj->len;
+		conn->wnext = conn->obj->chunks ? conn->obj->chunks->next : NULL;
+		conn->done = 1;
+		conn->state = CLIENT_WRITE;
+		return CONN_NEXT;
+	}
+#endif
+
+	/* Support only "GET" method */
+	if (!http_slice_eq(rq.method, "GET")) {
+		conn->rec.status = 501;
+		return conn_reply(conn, "HTTP/1.0 501 Not Implemented\r\n\r\n");
+	}
+
+	/* Only absolute http:// URIs name an origin */
+	if (!rq.host.len)
+		return CONN_CLOSE;
+
+	/*
+	 * Rewrite the request as HTTP/1.0, leaving out the hop-by-hop headers;
+	 * the engine serves one request a connection, so the origin closes
+	 */
+	conn->out = Malloc(EVENT_BUFSIZE + EVENT_HEADROOM);
+	len = snprintf(conn->out, EVENT_BUFSIZE, "GET /%.*s HTTP/1.0\r\n",
+		       rq.path.len, rq.path.ptr);
+	for (i = 0; i < rq.nheaders; i++) {
+		h = &rq.headers[i];
+		if (h->id == HTTP_CONNECTION || h->id == HTTP_KEEP_ALIVE ||
+		    h->id == HTTP_PROXY_CONNECTION)
+			continue;
+		if (len + h->line.len + 21 > EVENT_BUFSIZE)
+			return CONN_CLOSE;
+		memcpy(conn->out + len, h->line.ptr, h->line.len);
+		len += h->line.len;
+	}
+	len += sprintf(conn->out + len, "Connection: close\r\n\r\n");
+	conn->wptr = conn->out;
+	conn->wlen = len;
+	conn->wpos = 0;
+
+	/* The request line is rewritten, so the URI may be cut up in place */
+	host = http_slice_str(rq.host);
+	port = rq.port.len ? http_slice_str(rq.port) : "80";
+
+#ifdef CACHE_ENABLED
+	conn->rec.cache = ALOG_MISS;
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &conn->upstart);
+	if (conn_connect(conn, host, port) < 0)
+		return CONN_CLOSE;
+	conn->state = UPSTREAM_CONNECT;
+	return CONN_WAIT;
+}
+
+static int do_upstream_connect(conn_t *conn)
+{
+	socklen_t optlen = sizeof(int);
+	int err;
+	ssize_t n;
+
+	if (!conn->connected) {
+		if (getsockopt(conn->server_fd, SOL_SOCKET, SO_ERROR, &err, &optlen) < 0 || err)
+			return CONN_CLOSE;
+		conn->connected = 1;
+	}
+
+	/* Send the request */
+	while (conn->wpos < conn->wlen) {
+		n = send(conn->server_fd, conn->wptr + conn->wpos,
+			 conn->wlen - conn->wpos, MSG_NOSIGNAL);
+		if (n < 0 && errno == EAGAIN)
+			return conn_arm(conn, conn->server_fd, EPOLLOUT);
+		if (n < 0)
+			return CONN_CLOSE;
+		conn->wpos += n;
+	}
+
+#ifdef CACHE_ENABLED
+	conn->cache_buf = buf_new(&cache);
+#endif
+
+	conn->hdrlen = 0;
+	conn->hdr[0] = '\0';
+	conn->state = UPSTREAM_READ;
+	return CONN_NEXT;
+}
+
+static int do_upstream_read(conn_t *conn)
+{
+	char *end;
+	ssize_t n;
+	int cnt, body = 0;	/* body bytes in this block */
+
+	n = read(conn->server_fd, conn->out, EVENT_BUFSIZE);
+	if (n < 0 && errno == EAGAIN)
+		return conn_arm(conn, conn->server_fd, EPOLLIN);
+	if (n < 0)
+		return CONN_CLOSE;
+
+	conn->wptr = conn->out;
+	conn->wlen = n;
+	conn->wpos = 0;
+	conn->state = CLIENT_WRITE;
+
+	/* EOF ends the response; headers cut short go out as they came */
+	if (!n) {
+		if (!conn->hdrdone) {
+			conn->wptr = conn->hdr;
+			conn->wlen = conn->hdrlen;
+		}
+		conn->done = 1;
+		return CONN_NEXT;
+	}
+
+	/* Hold the headers back until their end shows up */
+	if (!conn->hdrdone) {
+		if (!conn->hdrlen)
+			stats_upstream(&stats, &conn->upstart);
+		cnt = n < MAXBUF - 1 - conn->hdrlen ? n : MAXBUF - 1 - conn->hdrlen;
+		memcpy(conn->hdr + conn->hdrlen, conn->out, cnt);
+		conn->hdrlen += cnt;
+		conn->hdr[conn->hdrlen] = '\0';
+
+		if ((end = strstr(conn->hdr, "\r\n\r\n"))) {
+			conn->hdrdone = 1;
+			conn_parse_response(conn);
+			conn->sum = conn->hdrlen - (end + 4 - conn->hdr) + (n - cnt);
+			body = conn->sum;
+			conn_client_head(conn, end + 2, n - body, body);
+#ifdef CACHE_ENABLED
+			conn_cache_headers(conn, end + 2);
+#endif
+		}
+		else if (conn->hdrlen == MAXBUF - 1) {
+			conn->hdrdone = 1;	/* give up; relay until EOF */
+			conn->cache_buf_failed = 1;
+			memmove(conn->out + conn->hdrlen, conn->out + cnt, n - cnt);
+			memcpy(conn->out, conn->hdr, conn->hdrlen);
+			conn->wlen = conn->hdrlen + n - cnt;
+		}
+		else {
+			conn->state = UPSTREAM_READ;
+			return CONN_NEXT;
+		}
+	}
+	else {
+		conn->sum += n;
+		body = n;
+	}
+
+#ifdef CACHE_ENABLED
+	/* Cache the body bytes of this block, which end the pending write */
+	if (body && buf_fill(conn->cache_buf, conn->wptr + conn->wlen - body, body) < 0)
+		conn->cache_buf_failed = 1;
+#endif
+
+	if (conn->hdrdone && conn->len >= 0 && conn->sum >= conn->len)
+		conn->done = 1;
+	return CONN_NEXT;
+}
+
+static int do_client_write(conn_t *conn)
+{
+	ssize_t n;
+
+	while (conn->wpos < conn->wlen || conn->wnext) {
+		/* A cached object goes out a chunk at a time */
+		if (conn->wpos == conn->wlen) {
+			conn->wptr = conn->wnext->data;
+			conn->wlen = conn->wnext->len;
+			conn->wpos = 0;
+			conn->wnext = conn->wnext->next;
+			continue;
+		}
+
+		n = send(conn->client_fd, conn->wptr + conn->wpos,
+			 conn->wlen - conn->wpos, MSG_NOSIGNAL);
+		if (n < 0 && errno == EAGAIN)
+			return conn_arm(conn, conn->client_fd, EPOLLOUT);
+		if (n < 0)
+			return CONN_CLOSE;
+		conn->wpos += n;
+	}
+
+	if (!conn->done) {
+		conn->state = UPSTREAM_READ;
+		return CONN_NEXT;
+	}
+
+#ifdef CACHE_ENABLED
+	/* Store a complete miss to the cache */
+	if (conn->cache_buf && !conn->cache_buf_failed && conn->hdrdone &&
+	    (conn->len < 0 || conn->sum == conn->len) &&
+	    conn->stat_code == 200 && conn->fresh.cacheable)
+		cache_write(&cache, conn->uri, conn->cache_buf,
+			    http_fresh_expiry(&conn->fresh, time(NULL)));
+#endif
+
+	return CONN_CLOSE;
+}
+
+static void conn_handle(conn_t *conn)
+{
+	int rc;
+
+	do {
+		switch (conn->state) {
+		case CLIENT_READ:
+			rc = do_client_read(conn);
+			break;
+		case UPSTREAM_CONNECT:
+			rc = do_upstream_connect(conn);
+			break;
+		case UPSTREAM_READ:
+			rc = do_upstream_read(conn);
+			break;
+		case CLIENT_WRITE:
+			rc = do_client_write(conn);
+			break;
+		default:
+			rc = CONN_CLOSE;
+		}
+	} while (rc == CONN_NEXT);
+
+	if (rc == CONN_CLOSE)
+		conn_close(conn);
+}
+
+/********************
+ * event loop
+ ********************/
+
+static void event_accept(int efd)
+{
+	struct epoll_event ev;
+	conn_t *conn;
+	int fd;
+
+	while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		conn = conn_new(efd, fd);
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = conn;
+		if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) < 0)
+			conn_close(conn);
+	}
+}
+
+static void *event_loop(void *vargp)
+{
+	struct epoll_event ev, events[EVENT_BATCH];
+	int efd, i, n;
+
+	if ((efd = epoll_create1(0)) < 0)
+		unix_error("epoll_create1 error");
+
+	/* Every loop accepts; EPOLLEXCLUSIVE wakes only one of them */
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+		unix_error("epoll_ctl error");
+
+	while (1) {
+		if ((n = epoll_wait(efd, events, EVENT_BATCH, -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			unix_error("epoll_wait error");
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr)
+				conn_handle(events[i].data.ptr);
+			else
+				event_accept(efd);
+		}
+	}
+
+	return NULL;
+}
+
+/********************
+ * event engine APIs
+ ********************/
+
+void event_run(int listenfd, int nloops)
+{
+	pthread_t tid;
+	int i;
+
+	listen_fd = listenfd;
+	if (fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK) < 0)
+		unix_error("fcntl error");
+
+	for (i = 1; i < nloops; i++)
+		Pthread_create(&tid, NULL, event_loop, NULL);
+	event_loop(NULL);
+}
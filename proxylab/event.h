@@ -0,0 +1,66 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include "proxy.h"
+
+/* size of the per-connection relay buffer */
+#define EVENT_BUFSIZE 65536
+
+/* room past a block for the rewritten response head put in front of it */
+#define EVENT_HEADROOM (MAXBUF + 32)
+
+/* max events handled per epoll_wait */
+#define EVENT_BATCH 256
+
+/********************
+ * data structures
+ ********************/
+
+typedef enum {
+	CLIENT_READ,		/* reading the request headers */
+	UPSTREAM_CONNECT,	/* connecting and sending the request */
+	UPSTREAM_READ,		/* reading the response */
+	CLIENT_WRITE		/* writing the response */
+} state_t;
+
+typedef struct {
+	state_t state;
+	int efd;		/* epoll instance of the owning loop */
+	int client_fd;
+	int server_fd;
+
+	/* request or response headers seen so far */
+	int hdrlen;
+	int hdrdone;
+	char hdr[MAXBUF];
+	char uri[MAXURI];
+
+	/* upstream request, then relay buffer */
+	char *out;
+
+	/* pending write */
+	char *wptr;
+	int wlen;
+	int wpos;
+	chunk_t *wnext;		/* chunks of a hit still to go after it */
+
+	/* response */
+	int connected;
+	int stat_code;
+	long len;		/* Content-Length or -1 */
+	long sum;		/* body bytes received */
+	int done;		/* the response is complete */
+
+	obj_t *obj;		/* pinned object of a hit */
+	buf_t *cache_buf;	/* object being collected on a miss */
+	int cache_buf_failed;
+	fresh_t fresh;		/* caching directives of the response */
+
+	struct timespec upstart;	/* when the upstream request began */
+	alogrec_t rec;		/* access log record, once the request is in */
+} conn_t;
+
+/* event engine APIs */
+void event_run(int listenfd, int nloops);
+
+#endif /* __EVENT_H__ */
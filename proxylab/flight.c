@@ -0,0 +1,124 @@
+#include "flight.h"
+#include "hash.h"
+
+/*************************
+ * flight_t static methods
+ *************************/
+
+static flight_t *flight_new(char *uri)
+{
+	flight_t *flight = Malloc(sizeof(flight_t));
+
+	flight->uri = strdup(uri);
+	flight->done = 0;
+	flight->waiters = 0;
+	pthread_cond_init(&flight->cond, NULL);
+	flight->next = NULL;
+
+	return flight;
+}
+
+static void flight_delete(flight_t *flight)
+{
+	pthread_cond_destroy(&flight->cond);
+	free(flight->uri);
+	free(flight);
+}
+
+/*************************
+ * flights_t static methods
+ *************************/
+
+static flight_t **flights_bucket(flights_t *flights, char *uri)
+{
+	return &flights->buckets[fnv1a(uri) % FLIGHT_BUCKETS];
+}
+
+static flight_t *flights_find(flights_t *flights, char *uri)
+{
+	flight_t *flight;
+
+	for (flight = *flights_bucket(flights, uri); flight; flight = flight->next)
+		if (!strcmp(flight->uri, uri))
+			break;
+
+	return flight;
+}
+
+static void flights_add(flights_t *flights, char *uri)
+{
+	flight_t **bucket = flights_bucket(flights, uri), *flight = flight_new(uri);
+
+	flight->next = *bucket;
+	*bucket = flight;
+}
+
+/********************
+ * flights_t APIs
+ ********************/
+
+void flights_init(flights_t *flights)
+{
+	pthread_mutex_init(&flights->lock, NULL);
+	memset(flights->buckets, 0, sizeof(flights->buckets));
+}
+
+/*
+ * Returns 1 if the caller is the first to fetch uri and must call
+ * flight_end() when done. Otherwise waits for that fetch to end and
+ * returns 0, after which the object is in the cache if it was cacheable.
+ */
+int flight_begin(flights_t *flights, char *uri)
+{
+	flight_t *flight;
+
+	pthread_mutex_lock(&flights->lock);
+	if (!(flight = flights_find(flights, uri))) {
+		flights_add(flights, uri);
+		pthread_mutex_unlock(&flights->lock);
+		return 1;
+	}
+
+	flight->waiters++;
+	while (!flight->done)
+		pthread_cond_wait(&flight->cond, &flights->lock);
+
+	/* The last waiter out frees the finished flight */
+	if (!--flight->waiters)
+		flight_delete(flight);
+	pthread_mutex_unlock(&flights->lock);
+	return 0;
+}
+
+/* Like flight_begin(), but returns 0 at once if uri is being fetched */
+int flight_trybegin(flights_t *flights, char *uri)
+{
+	int leader;
+
+	pthread_mutex_lock(&flights->lock);
+	if ((leader = !flights_find(flights, uri)))
+		flights_add(flights, uri);
+	pthread_mutex_unlock(&flights->lock);
+
+	return leader;
+}
+
+void flight_end(flights_t *flights, char *uri)
+{
+	flight_t **link, *flight;
+
+	pthread_mutex_lock(&flights->lock);
+	for (link = flights_bucket(flights, uri); (flight = *link); link = &flight->next)
+		if (!strcmp(flight->uri, uri))
+			break;
+
+	if (flight) {
+		*link = flight->next;
+		flight->done = 1;
+		if (flight->waiters)
+			pthread_cond_broadcast(&flight->cond);
+		else
+			flight_delete(flight);
+	}
+	pthread_mutex_unlock(&flights->lock);
+}
@@ -0,0 +1,34 @@
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include "csapp.h"
+
+/* number of hash buckets for in-flight URIs */
+#define FLIGHT_BUCKETS 64
+
+/********************
+ * data structures
+ ********************/
+
+/* an upstream fetch in progress */
+typedef struct __flight {
+	char *uri;
+	int done;
+	int waiters;
+	pthread_cond_t cond;
+	struct __flight *next;
+} flight_t;
+
+/* in-flight fetches keyed by URI */
+typedef struct {
+	pthread_mutex_t lock;
+	flight_t *buckets[FLIGHT_BUCKETS];
+} flights_t;
+
+/* flights_t APIs */
+void flights_init(flights_t *flights);
+int flight_begin(flights_t *flights, char *uri);
+int flight_trybegin(flights_t *flights, char *uri);
+void flight_end(flights_t *flights, char *uri);
+
+#endif /* __FLIGHT_H__ */
@@ -0,0 +1,21 @@
+#ifndef __HASH_H__
+#define __HASH_H__
+
+/*
+ * FNV-1a hash of a string, with the 32-bit offset basis and prime; the
+ * cache, the disk tier, the flight table, the upstream pool and the
+ * resolver cache all key their tables by it
+ */
+static inline unsigned long fnv1a(char *str)
+{
+	unsigned long hash = 2166136261UL;
+
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619UL;
+	}
+
+	return hash;
+}
+
+#endif /* __HASH_H__ */
@@ -0,0 +1,488 @@
+#include "http.h"
+
+/*
+ * The parser walks a request head once, left to right, and records where
+ * every part lies instead of copying it out. A character class table
+ * decides what may appear where, and header names are matched against a
+ * table of the headers the proxy acts on while they are scanned, so the
+ * callers switch on an id rather than comparing names themselves.
+ *
+ * Lines may end with CRLF or a bare LF, and runs of blanks separate the
+ * parts of the request line. Anything else that is not well formed,
+ * including folded header lines, makes the parse fail.
+ */
+
+/* character classes */
+#define C_TCHAR	0x01		/* may appear in a method or a header name */
+#define C_VCHAR	0x02		/* may appear in a URI or a version */
+#define C_BLANK	0x04		/* space or tab */
+
+#define T (C_TCHAR | C_VCHAR)
+#define V C_VCHAR
+
+static const unsigned char http_class[256] = {
+	['\t'] = C_BLANK, [' '] = C_BLANK,
+	['!'] = T, ['"'] = V, ['#' ... '\''] = T, ['(' ... ')'] = V,
+	['*' ... '+'] = T, [','] = V, ['-' ... '.'] = T, ['/'] = V,
+	['0' ... '9'] = T, [':' ... '@'] = V, ['A' ... 'Z'] = T,
+	['[' ... ']'] = V, ['^' ... 'z'] = T, ['{'] = V, ['|'] = T,
+	['}'] = V, ['~'] = T, [0x80 ... 0xff] = V
+};
+
+#undef T
+#undef V
+
+/* headers told apart, by name */
+static const struct {
+	char *name;
+	int len;
+	int id;
+} http_known[] = {
+	{ "Connection", 10, HTTP_CONNECTION },
+	{ "Keep-Alive", 10, HTTP_KEEP_ALIVE },
+	{ "Proxy-Connection", 16, HTTP_PROXY_CONNECTION },
+	{ "Content-Length", 14, HTTP_CONTENT_LENGTH },
+	{ "Content-Type", 12, HTTP_CONTENT_TYPE },
+	{ "Host", 4, HTTP_HOST },
+	{ "If-Modified-Since", 17, HTTP_IF_MODIFIED_SINCE },
+	{ "If-None-Match", 13, HTTP_IF_NONE_MATCH },
+	{ "If-Range", 8, HTTP_IF_RANGE },
+	{ "Range", 5, HTTP_RANGE },
+	{ NULL, 0, HTTP_OTHER }
+};
+
+/********************
+ * static helpers
+ ********************/
+
+/* id of a header name */
+static int http_header_id(char *name, int len)
+{
+	int i;
+
+	for (i = 0; http_known[i].name; i++)
+		if (http_known[i].len == len && !strncasecmp(http_known[i].name, name, len))
+			return http_known[i].id;
+	return HTTP_OTHER;
+}
+
+/*
+ * Length of the line break at p, or 0 if p holds none; -1 if the data
+ * ends before it is known, or on a CR without its LF
+ */
+static int http_eol(char *p, char *end)
+{
+	if (p == end)
+		return -1;
+	if (*p == '\n')
+		return 1;
+	if (*p != '\r')
+		return 0;
+	if (p + 1 == end)
+		return -1;
+	return p[1] == '\n' ? 2 : -2;
+}
+
+/* Skips blanks; the data must not end there */
+static char *http_blanks(char *p, char *end)
+{
+	while (p < end && (http_class[(unsigned char)*p] & C_BLANK))
+		p++;
+	return p;
+}
+
+/* Scans a run of characters of class c into s */
+static char *http_run(char *p, char *end, int c, slice_t *s)
+{
+	s->ptr = p;
+	while (p < end && (http_class[(unsigned char)*p] & c))
+		p++;
+	s->len = p - s->ptr;
+	return p;
+}
+
+/********************
+ * parser APIs
+ ********************/
+
+/*
+ * Parses a request head out of the len bytes at data. Returns the length
+ * of the head, up to and including the empty line that ends it; 0 if the
+ * data ends before that; -1 if the request is malformed.
+ */
+int http_parse_request(char *data, int len, request_t *req)
+{
+	char *p = data, *end = data + len;
+	header_t *hdr;
+	int n;
+
+	/* request line: method SP URI SP version */
+	req->line.ptr = p;
+	p = http_run(p, end, C_TCHAR, &req->method);
+	if (p == end)
+		return 0;
+	if (!req->method.len || !(http_class[(unsigned char)*p] & C_BLANK))
+		return -1;
+	p = http_run(http_blanks(p, end), end, C_VCHAR, &req->uri);
+	if (p == end)
+		return 0;
+	if (!req->uri.len || !(http_class[(unsigned char)*p] & C_BLANK))
+		return -1;
+	p = http_run(http_blanks(p, end), end, C_VCHAR, &req->version);
+	p = http_blanks(p, end);
+	if ((n = http_eol(p, end)) == -1)
+		return 0;
+	if (n <= 0 || !req->version.len)
+		return -1;
+	p += n;
+	req->line.len = p - data;
+
+	if (http_parse_uri(req->uri.ptr, req->uri.len, &req->host, &req->port, &req->path) < 0)
+		req->host.len = 0;
+
+	/* headers, up to the empty line */
+	for (req->nheaders = 0; (n = http_eol(p, end)) == 0; p += n) {
+		if (req->nheaders == HTTP_MAX_HEADERS)
+			return -1;
+		hdr = &req->headers[req->nheaders++];
+		if ((n = http_parse_header(p, end - p, hdr)) <= 0)
+			return n;
+	}
+	if (n == -1)
+		return 0;
+	if (n < 0)
+		return -1;
+
+	return p + n - data;
+}
+
+/*
+ * Parses the header line at data: a name, a colon and a value. Returns
+ * the length of the line with its line break, 0 if the data ends before
+ * that, or -1 if the line is malformed.
+ */
+int http_parse_header(char *data, int len, header_t *hdr)
+{
+	char *p = data, *end = data + len, *eol, *last;
+
+	hdr->line.ptr = data;
+	p = http_run(p, end, C_TCHAR, &hdr->name);
+	if (p == end)
+		return 0;
+	if (!hdr->name.len || *p != ':')
+		return -1;
+	hdr->id = http_header_id(hdr->name.ptr, hdr->name.len);
+
+	/* The value runs to the line break, less the blanks around it */
+	if (!(eol = memchr(p, '\n', end - p)))
+		return 0;
+	hdr->line.len = eol + 1 - data;
+	last = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+	p = http_blanks(p + 1, last);
+	if (p < last && memchr(p, '\r', last - p))
+		return -1;
+	while (last > p && (http_class[(unsigned char)last[-1]] & C_BLANK))
+		last--;
+	hdr->value.ptr = p;
+	hdr->value.len = last - p;
+
+	return hdr->line.len;
+}
+
+/*
+ * Splits an absolute http:// URI into its host, its port and its path
+ * after the first '/'. Brackets around an IPv6 host are left out.
+ * Returns 0, or -1 if the URI is not of that form.
+ */
+int http_parse_uri(char *uri, int len, slice_t *host, slice_t *port, slice_t *path)
+{
+	char *p = uri + 7, *end = uri + len;
+
+	if (len < 7 || strncasecmp(uri, "http://", 7))
+		return -1;
+
+	if (p < end && *p == '[') {
+		host->ptr = ++p;
+		while (p < end && *p != ']')
+			p++;
+		if (p == end)
+			return -1;
+		host->len = p++ - host->ptr;
+	}
+	else {
+		host->ptr = p;
+		while (p < end && *p != ':' && *p != '/' && *p != '?')
+			p++;
+		host->len = p - host->ptr;
+	}
+	if (!host->len)
+		return -1;
+
+	port->ptr = p;
+	port->len = 0;
+	if (p < end && *p == ':') {
+		port->ptr = ++p;
+		while (p < end && *p >= '0' && *p <= '9')
+			p++;
+		port->len = p - port->ptr;
+	}
+
+	if (p < end && *p != '/' && *p != '?')
+		return -1;
+	if (p < end && *p == '/')
+		p++;
+	path->ptr = p;
+	path->len = end - p;
+
+	return 0;
+}
+
+/*
+ * Copies the host, the port ("80" if none) and the path of an absolute
+ * http:// URI out into NUL-terminated buffers of size bytes each. The
+ * URI is left as it is: the host may end right where the path starts,
+ * as in "http://host?q=1", so cutting it in place would eat the path.
+ * Returns 0, or -1 if the URI is not of that form or a part does not fit.
+ */
+int http_split_uri(char *uri, char *host, char *port, char *path, int size)
+{
+	slice_t h, p, pa;
+
+	if (http_parse_uri(uri, strlen(uri), &h, &p, &pa) < 0 ||
+	    h.len >= size || p.len >= size || pa.len >= size)
+		return -1;
+
+	snprintf(host, size, "%.*s", h.len, h.ptr);
+	snprintf(port, size, "%.*s", p.len ? p.len : 2, p.len ? p.ptr : "80");
+	snprintf(path, size, "%.*s", pa.len, pa.ptr);
+	return 0;
+}
+
+/********************
+ * slice helpers
+ ********************/
+
+/* does the slice equal str, ignoring case */
+int http_slice_eq(slice_t s, char *str)
+{
+	return (int)strlen(str) == s.len && !strncasecmp(s.ptr, str, s.len);
+}
+
+/* does the slice contain token, ignoring case */
+int http_slice_has(slice_t s, char *token)
+{
+	int n = strlen(token), i;
+
+	for (i = 0; i + n <= s.len; i++)
+		if (!strncasecmp(s.ptr + i, token, n))
+			return 1;
+	return 0;
+}
+
+/*
+ * NUL-terminates a slice in place, overwriting the byte after it, which
+ * must be no longer needed; returns its first character
+ */
+char *http_slice_str(slice_t s)
+{
+	s.ptr[s.len] = '\0';
+	return s.ptr;
+}
+
+/********************
+ * header helpers
+ ********************/
+
+/* hop-by-hop headers are neither forwarded nor cached */
+int http_hop_header(char *line)
+{
+	return !strncasecmp(line, "Connection:", 11) ||
+	       !strncasecmp(line, "Keep-Alive:", 11) ||
+	       !strncasecmp(line, "Proxy-Connection:", 17);
+}
+
+/* does the value of a header line contain token */
+int http_has_token(char *line, char *token)
+{
+	int n = strlen(token);
+
+	for (line = strchr(line, ':'); line && *line; line++)
+		if (!strncasecmp(line, token, n))
+			return 1;
+	return 0;
+}
+
+/* size of the status line and headers, up to the empty line, or -1 */
+int http_header_size(char *data, int size)
+{
+	int i;
+
+	for (i = 0; i + 4 <= size; i++)
+		if (!memcmp(data + i, "\r\n\r\n", 4))
+			return i + 2;
+	return -1;
+}
+
+/*
+ * copies the value of the header name (with its colon) out of the header
+ * block of a cached object; returns -1 if it is missing or too long
+ */
+int http_header_value(char *data, int size, char *name, char *value, int len)
+{
+	int n = strlen(name), hdrsize = http_header_size(data, size);
+	char *line, *eol, *end = data + hdrsize;
+
+	if (hdrsize < 0)
+		return -1;
+
+	for (line = data; line < end && (eol = memchr(line, '\r', end - line)); line = eol + 2) {
+		if (eol - line < n || strncasecmp(line, name, n))
+			continue;
+		for (line += n; line < eol && *line == ' '; line++)
+			;
+		if (eol - line >= len)
+			return -1;
+		memcpy(value, line, eol - line);
+		value[eol - line] = '\0';
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * resolves a single "bytes=" range of a Range header against a body of
+ * total bytes; returns 1 if satisfiable, -1 if not, and 0 if the header
+ * is to be ignored (malformed, or several ranges)
+ */
+int http_range(char *spec, long total, long *first, long *last)
+{
+	char *end;
+	long a, b;
+
+	if (strncasecmp(spec, "bytes=", 6) || strchr(spec, ','))
+		return 0;
+	spec += 6;
+
+	/* The last b bytes */
+	if (*spec == '-') {
+		b = strtol(spec + 1, &end, 10);
+		if (end == spec + 1 || *end)
+			return 0;
+		if (!b || !total)
+			return -1;
+		*first = b < total ? total - b : 0;
+		*last = total - 1;
+		return 1;
+	}
+
+	a = strtol(spec, &end, 10);
+	if (end == spec || *end != '-' || a < 0)
+		return 0;
+	if (*(spec = end + 1)) {
+		b = strtol(spec, &end, 10);
+		if (*end || b < a)
+			return 0;
+	}
+	else
+		b = total - 1;
+
+	if (a >= total)
+		return -1;
+	*first = a;
+	*last = b < total ? b : total - 1;
+	return 1;
+}
+
+/********************
+ * freshness
+ ********************/
+
+/* parses an HTTP-date such as "Sun, 06 Nov 1994 08:49:37 GMT", or -1 */
+time_t http_date(char *value)
+{
+	static char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	char mon[4], *m;
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(value, "%*3s, %d %3s %d %d:%d:%d", &tm.tm_mday, mon,
+		   &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 ||
+	    strlen(mon) != 3 || !(m = strstr(months, mon)) || (m - months) % 3)
+		return -1;
+
+	tm.tm_mon = (m - months) / 3;
+	tm.tm_year -= 1900;
+	return timegm(&tm);
+}
+
+/* value of a "name=<seconds>" directive of a header line, or -1 */
+static long http_directive(char *line, char *name)
+{
+	int n = strlen(name);
+
+	for (line = strchr(line, ':'); line && *line; line++)
+		if (!strncasecmp(line, name, n))
+			return atol(line + n);
+	return -1;
+}
+
+void http_fresh_init(fresh_t *fresh)
+{
+	fresh->cacheable = 1;
+	fresh->no_cache = 0;
+	fresh->max_age = -1;
+	fresh->expires = -1;
+	fresh->date = -1;
+	fresh->last_modified = -1;
+}
+
+/* gathers the caching directives of one response header line */
+void http_fresh_header(fresh_t *fresh, char *line)
+{
+	long age;
+	time_t t;
+
+	if (!strncasecmp(line, "Cache-Control:", 14)) {
+		if (http_has_token(line, "no-store") || http_has_token(line, "private"))
+			fresh->cacheable = 0;
+		if (http_has_token(line, "no-cache"))
+			fresh->no_cache = 1;
+		if ((age = http_directive(line, "s-maxage=")) >= 0)
+			fresh->max_age = age;
+		else if ((age = http_directive(line, "max-age=")) >= 0 && fresh->max_age < 0)
+			fresh->max_age = age;
+	}
+	else if (!strncasecmp(line, "Expires:", 8))
+		fresh->expires = (t = http_date(line + 9)) < 0 ? 0 : t;
+	else if (!strncasecmp(line, "Date:", 5))
+		fresh->date = http_date(line + 6);
+	else if (!strncasecmp(line, "Last-Modified:", 14))
+		fresh->last_modified = http_date(line + 15);
+}
+
+/*
+ * the time until which a response received at now is fresh, or 0 if it
+ * must be revalidated on every use
+ */
+time_t http_fresh_expiry(fresh_t *fresh, time_t now)
+{
+	long age;
+
+	if (fresh->no_cache)
+		return 0;
+	if (fresh->max_age >= 0)
+		return now + fresh->max_age;
+
+	/* Expires is relative to the clock of the origin */
+	if (fresh->expires > 0 && fresh->date >= 0)
+		return now + (fresh->expires - fresh->date);
+	if (fresh->expires >= 0)
+		return fresh->expires;
+
+	/* Heuristic: a tenth of the time since the last modification */
+	if (fresh->last_modified >= 0) {
+		age = ((fresh->date >= 0 ? fresh->date : now) - fresh->last_modified) / 10;
+		return now + (age < 0 ? 0 : age > HTTP_HEURISTIC_MAX ? HTTP_HEURISTIC_MAX : age);
+	}
+	return now + HTTP_DEFAULT_TTL;
+}
@@ -0,0 +1,94 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+
+/* most headers a request may carry */
+#define HTTP_MAX_HEADERS 100
+
+/* freshness of responses that state none, in seconds */
+#define HTTP_DEFAULT_TTL 300
+#define HTTP_HEURISTIC_MAX 86400
+
+/* headers told apart while parsing; HTTP_OTHER for the rest */
+enum {
+	HTTP_OTHER,
+	HTTP_CONNECTION,
+	HTTP_KEEP_ALIVE,
+	HTTP_PROXY_CONNECTION,
+	HTTP_CONTENT_LENGTH,
+	HTTP_CONTENT_TYPE,
+	HTTP_HOST,
+	HTTP_IF_MODIFIED_SINCE,
+	HTTP_IF_NONE_MATCH,
+	HTTP_IF_RANGE,
+	HTTP_RANGE
+};
+
+/********************
+ * data structures
+ ********************/
+
+/* bytes of a parsed buffer, not NUL-terminated */
+typedef struct {
+	char *ptr;
+	int len;
+} slice_t;
+
+typedef struct {
+	int id;			/* HTTP_* of the name */
+	slice_t name;
+	slice_t value;		/* without the surrounding blanks */
+	slice_t line;		/* the whole line with its line break */
+} header_t;
+
+typedef struct {
+	slice_t line;		/* the request line with its line break */
+	slice_t method;
+	slice_t uri;
+	slice_t version;
+
+	/* parts of an absolute http:// URI; path leaves out the first '/' */
+	slice_t host;
+	slice_t port;		/* empty if the URI names none */
+	slice_t path;
+
+	int nheaders;
+	header_t headers[HTTP_MAX_HEADERS];
+} request_t;
+
+/* caching directives of a response, gathered header by header */
+typedef struct {
+	int cacheable;		/* no no-store or private */
+	int no_cache;
+	long max_age;		/* -1 if absent; s-maxage wins */
+	time_t expires;		/* -1 if absent, 0 if invalid */
+	time_t date;		/* -1 if absent */
+	time_t last_modified;	/* -1 if absent */
+} fresh_t;
+
+/* parser APIs */
+int http_parse_request(char *data, int len, request_t *req);
+int http_parse_header(char *data, int len, header_t *hdr);
+int http_parse_uri(char *uri, int len, slice_t *host, slice_t *port, slice_t *path);
+int http_split_uri(char *uri, char *host, char *port, char *path, int size);
+
+/* slice helpers */
+int http_slice_eq(slice_t s, char *str);
+int http_slice_has(slice_t s, char *token);
+char *http_slice_str(slice_t s);
+
+/* header helpers, over NUL-terminated lines and cached header blocks */
+int http_hop_header(char *line);
+int http_has_token(char *line, char *token);
+int http_header_size(char *data, int size);
+int http_header_value(char *data, int size, char *name, char *value, int len);
+int http_range(char *spec, long total, long *first, long *last);
+
+/* freshness */
+time_t http_date(char *value);
+void http_fresh_init(fresh_t *fresh);
+void http_fresh_header(fresh_t *fresh, char *line);
+time_t http_fresh_expiry(fresh_t *fresh, time_t now);
+
+#endif /* __HTTP_H__ */
@@ -0,0 +1,196 @@
+/*
+ * httpbench.c - benchmark of request head parsing
+ *
+ * httpbench times what proxy() does with a request head before it goes
+ * upstream, the old way and the new one, on the same browser-like
+ * request:
+ *
+ *   old: a line at a time copied out, the request line split with
+ *        sscanf, the headers told apart with a chain of strncasecmp,
+ *        and the URI cut up with strtok (as proxy.c did before http.c)
+ *   new: one pass of http_parse_request over the head, the headers
+ *        told apart by id
+ *
+ * Both build the forwarded header block the same way, and the best of
+ * the passes is reported in ns per request.
+ *
+ * usage: httpbench [-n <requests>] [-r <passes>]
+ */
+
+/**************************************************
+ * [2013-11706] Kang Injae,
+ * Dept. of Mechanical & Aerospace Engineering
+ **************************************************/
+
+#include "http.h"
+
+#define DEF_REQUESTS 1000000
+#define DEF_PASSES 3
+
+static char *request =
+	"GET http://www.example.com:8080/images/logo.png?v=3 HTTP/1.1\r\n"
+	"Host: www.example.com:8080\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Referer: http://www.example.com/index.html\r\n"
+	"Cookie: session=abcdef0123456789; theme=dark\r\n"
+	"Connection: keep-alive\r\n"
+	"If-None-Match: \"abc\"\r\n"
+	"\r\n";
+
+static volatile long sink;
+
+/********************
+ * parsers
+ ********************/
+
+/* the parse_uri of proxy.c before http.c */
+static int old_parse_uri(char *uri, char **host, char **port, char **path)
+{
+	if (strncasecmp(uri, "http://", 7))
+		return 1;
+
+	*host = uri + 7;
+	strtok(*host, "/");
+	*path = *host + strlen(*host) + 1;
+	strtok(*host, ":");
+	if (!(*port = strtok(NULL, ":")))
+		*port = "80";
+	return 0;
+}
+
+static int old_parse(char *head, int len, char *hdrs)
+{
+	char buf[MAXBUF], method[16], uri[MAXLINE], ver[16];
+	char *line, *eol, *host, *port, *path;
+	int n, hdrlen = 0, keep;
+
+	eol = memchr(head, '\n', len);
+	memcpy(buf, head, eol + 1 - head);
+	buf[eol + 1 - head] = '\0';
+	sscanf(buf, "%15s %8191s %15s", method, uri, ver);
+	keep = !strcasecmp(ver, "HTTP/1.1");
+
+	for (line = eol + 1; (eol = memchr(line, '\n', head + len - line)); line = eol + 1) {
+		n = eol + 1 - line;
+		memcpy(buf, line, n);
+		buf[n] = '\0';
+		if (!strncmp(buf, "\r\n", 2))
+			break;
+		if (!strncasecmp(buf, "Connection:", 11) || !strncasecmp(buf, "Keep-Alive:", 11) ||
+		    !strncasecmp(buf, "Proxy-Connection:", 17))
+			keep = !strstr(buf, "close");
+		else if (strncasecmp(buf, "If-None-Match:", 14) &&
+			 strncasecmp(buf, "If-Modified-Since:", 18) &&
+			 strncasecmp(buf, "Range:", 6) && strncasecmp(buf, "If-Range:", 9)) {
+			memcpy(hdrs + hdrlen, buf, n);
+			hdrlen += n;
+		}
+	}
+
+	if (old_parse_uri(uri, &host, &port, &path))
+		return -1;
+	return hdrlen + keep + *path;
+}
+
+static int new_parse(char *head, int len, char *hdrs)
+{
+	int hdrlen = 0, keep, i;
+	request_t rq;
+	header_t *h;
+
+	if (http_parse_request(head, len, &rq) != len || !rq.host.len)
+		return -1;
+	keep = http_slice_eq(rq.version, "HTTP/1.1");
+
+	for (i = 0; i < rq.nheaders; i++) {
+		h = &rq.headers[i];
+		switch (h->id) {
+		case HTTP_CONNECTION:
+		case HTTP_KEEP_ALIVE:
+		case HTTP_PROXY_CONNECTION:
+			keep = !http_slice_has(h->value, "close");
+			break;
+		case HTTP_IF_MODIFIED_SINCE:
+		case HTTP_IF_NONE_MATCH:
+		case HTTP_RANGE:
+		case HTTP_IF_RANGE:
+			break;
+		default:
+			memcpy(hdrs + hdrlen, h->line.ptr, h->line.len);
+			hdrlen += h->line.len;
+		}
+	}
+	return hdrlen + keep + *rq.path.ptr;
+}
+
+/********************
+ * benchmark
+ ********************/
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	static int (*parsers[])(char *, int, char *) = { old_parse, new_parse };
+	static char *names[] = { "sscanf/strtok", "http_parse_request" };
+	static char head[MAXBUF], hdrs[MAXBUF];
+	int c, i, p, r, len = strlen(request), nrequests = DEF_REQUESTS, npasses = DEF_PASSES;
+	double t, best[2] = { 0, 0 };
+
+	while ((c = getopt(argc, argv, "n:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			nrequests = atoi(optarg);
+			break;
+		case 'r':
+			npasses = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || nrequests < 1 || npasses < 1)
+		goto usage;
+
+	/* The parsers must agree before they are timed */
+	memcpy(head, request, len);
+	r = old_parse(head, len, hdrs);
+	memcpy(head, request, len);
+	if (r < 0 || new_parse(head, len, hdrs) != r) {
+		fprintf(stderr, "the parsers disagree\n");
+		exit(1);
+	}
+
+	/* Every request is parsed out of a fresh copy, as if just read */
+	for (r = 0; r < npasses; r++) {
+		for (p = 0; p < 2; p++) {
+			t = now_ns();
+			for (i = 0; i < nrequests; i++) {
+				memcpy(head, request, len);
+				sink += parsers[p](head, len, hdrs);
+			}
+			t = now_ns() - t;
+			if (!r || t < best[p])
+				best[p] = t;
+		}
+	}
+
+	printf("%d-byte request, best of %d passes of %d\n", len, npasses, nrequests);
+	for (p = 0; p < 2; p++)
+		printf("%-20s %8.1f ns/request %6.2fx\n", names[p], best[p] / nrequests,
+		       best[0] / best[p]);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-n <requests>] [-r <passes>]\n", argv[0]);
+	exit(1);
+}
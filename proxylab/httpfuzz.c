@@ -0,0 +1,249 @@
+/*
+ * httpfuzz.c - corpus and mutation checks of the request parser
+ *
+ * httpfuzz first parses every file of the corpus directory and checks
+ * the outcome its name promises: ok-* heads parse, part-* ones are
+ * incomplete and bad-* ones are malformed. It then feeds the parser
+ * mutations of the corpus files (bytes overwritten, inserted or deleted,
+ * and the input cut short) and checks on every input that
+ *
+ *   - the parse never claims more bytes than it was given,
+ *   - every slice of a complete head lies within the input,
+ *   - http_split_uri copies out the same host, port and path, and
+ *   - no strict prefix of a complete head parses.
+ *
+ * The mutations come from a fixed seed, so a failure can be replayed.
+ *
+ * usage: httpfuzz [-n <inputs>] [-s <seed>] [corpus-dir]
+ */
+
+/**************************************************
+ * [2013-11706] Kang Injae,
+ * Dept. of Mechanical & Aerospace Engineering
+ **************************************************/
+
+#include <dirent.h>
+
+#include "http.h"
+
+#define DEF_INPUTS 1000000
+#define DEF_CORPUS "httpcorpus"
+#define MAX_SEEDS 256
+
+typedef struct {
+	char *name;
+	char *data;
+	int len;
+} seed_t;
+
+static seed_t seeds[MAX_SEEDS];
+static int nseeds;
+
+static unsigned long rng = 88172645463325252UL;
+
+/* xorshift64 */
+static unsigned int rnd(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return (unsigned int)rng;
+}
+
+/********************
+ * corpus
+ ********************/
+
+static void load_corpus(char *dir)
+{
+	char path[MAXLINE];
+	struct dirent *de;
+	struct stat st;
+	DIR *dp;
+	int fd;
+
+	if (!(dp = opendir(dir)))
+		unix_error("opendir error");
+	while ((de = readdir(dp)) && nseeds < MAX_SEEDS) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		fd = Open(path, O_RDONLY, 0);
+		Fstat(fd, &st);
+		if (st.st_size >= MAXBUF) {
+			fprintf(stderr, "%s: larger than MAXBUF\n", path);
+			exit(1);
+		}
+		seeds[nseeds].name = strdup(de->d_name);
+		seeds[nseeds].data = Malloc(st.st_size + 1);
+		seeds[nseeds].len = Rio_readn(fd, seeds[nseeds].data, st.st_size);
+		nseeds++;
+		Close(fd);
+	}
+	closedir(dp);
+}
+
+/********************
+ * checks
+ ********************/
+
+#define WITHIN(s) ((s).len >= 0 && (s).ptr >= buf && (s).ptr + (s).len <= buf + n)
+
+/* does the slice hold just str */
+static int same(slice_t s, char *str)
+{
+	return (int)strlen(str) == s.len && !memcmp(s.ptr, str, s.len);
+}
+
+/* Splits a copy of the URI; returns 0 if it is left whole and the parts match */
+static int check_split(request_t *rq)
+{
+	char uri[MAXBUF], host[MAXBUF], port[MAXBUF], path[MAXBUF];
+
+	memcpy(uri, rq->uri.ptr, rq->uri.len);
+	uri[rq->uri.len] = '\0';
+	if (http_split_uri(uri, host, port, path, MAXBUF) < 0 ||
+	    memcmp(uri, rq->uri.ptr, rq->uri.len))
+		return -1;
+	return same(rq->host, host) && (rq->port.len ? same(rq->port, port) : !strcmp(port, "80")) &&
+	       same(rq->path, path) ? 0 : -1;
+}
+
+/* Checks one input; returns the parse result, or exits on a violation */
+static int check(char *what, char *buf, int n)
+{
+	request_t rq;
+	int r, i, k;
+
+	if ((r = http_parse_request(buf, n, &rq)) > n) {
+		printf("FAILED: %s: parsed %d of %d bytes\n", what, r, n);
+		exit(1);
+	}
+	if (r <= 0)
+		return r;
+
+	if (!WITHIN(rq.line) || !WITHIN(rq.method) || !WITHIN(rq.uri) ||
+	    !WITHIN(rq.version) || rq.nheaders > HTTP_MAX_HEADERS ||
+	    (rq.host.len && (!WITHIN(rq.host) || !WITHIN(rq.port) || !WITHIN(rq.path)))) {
+		printf("FAILED: %s: request slice out of the input\n", what);
+		exit(1);
+	}
+	if (rq.host.len && !memchr(rq.uri.ptr, '\0', rq.uri.len) && check_split(&rq) < 0) {
+		printf("FAILED: %s: http_split_uri disagrees with the slices\n", what);
+		exit(1);
+	}
+	for (i = 0; i < rq.nheaders; i++)
+		if (!WITHIN(rq.headers[i].line) || !WITHIN(rq.headers[i].name) ||
+		    !WITHIN(rq.headers[i].value)) {
+			printf("FAILED: %s: header %d out of the input\n", what, i);
+			exit(1);
+		}
+
+	k = rnd() % r;
+	if (http_parse_request(buf, k, &rq) > 0) {
+		printf("FAILED: %s: a %d-byte prefix of a %d-byte head parsed\n", what, k, r);
+		exit(1);
+	}
+	return r;
+}
+
+/* Runs the corpus files; returns the failures */
+static int check_corpus(void)
+{
+	static char buf[MAXBUF];
+	int i, r, ok, failures = 0;
+
+	for (i = 0; i < nseeds; i++) {
+		memcpy(buf, seeds[i].data, seeds[i].len);
+		r = check(seeds[i].name, buf, seeds[i].len);
+		if (!strncmp(seeds[i].name, "ok-", 3))
+			ok = r > 0;
+		else if (!strncmp(seeds[i].name, "part-", 5))
+			ok = r == 0;
+		else if (!strncmp(seeds[i].name, "bad-", 4))
+			ok = r < 0;
+		else
+			continue;
+		printf("%s: %s (%d)\n", ok ? "ok" : "FAILED", seeds[i].name, r);
+		failures += !ok;
+	}
+	return failures;
+}
+
+/* Mutates a corpus file into buf; returns its length */
+static int mutate(char *buf)
+{
+	seed_t *s = &seeds[rnd() % nseeds];
+	int n = s->len, m = rnd() % 8, i, j;
+
+	memcpy(buf, s->data, n);
+	for (i = 0; i < m && n > 0; i++) {
+		switch (rnd() % 5) {
+		case 0:
+			buf[rnd() % n] = rnd();
+			break;
+		case 1:
+			buf[rnd() % n] = "\r\n :/[]\t"[rnd() % 8];
+			break;
+		case 2:
+			if (n < MAXBUF - 1) {
+				j = rnd() % n;
+				memmove(buf + j + 1, buf + j, n - j);
+				buf[j] = "\r\n :"[rnd() % 4];
+				n++;
+			}
+			break;
+		case 3:
+			j = rnd() % n;
+			memmove(buf + j, buf + j + 1, n - j - 1);
+			n--;
+			break;
+		default:
+			n = rnd() % (n + 1);
+		}
+	}
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	static char buf[MAXBUF];
+	long i, inputs = DEF_INPUTS, counts[3] = { 0, 0, 0 };
+	int c, r, failures;
+
+	while ((c = getopt(argc, argv, "n:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			inputs = atol(optarg);
+			break;
+		case 's':
+			rng = strtoul(optarg, NULL, 0) | 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind < argc - 1 || inputs < 0)
+		goto usage;
+
+	load_corpus(optind < argc ? argv[optind] : DEF_CORPUS);
+	if (!nseeds) {
+		fprintf(stderr, "empty corpus\n");
+		exit(1);
+	}
+	failures = check_corpus();
+
+	for (i = 0; i < inputs; i++) {
+		r = check("mutation", buf, mutate(buf));
+		counts[r > 0 ? 0 : r == 0 ? 1 : 2]++;
+	}
+	printf("%ld mutations: %ld complete, %ld incomplete, %ld malformed\n",
+	       inputs, counts[0], counts[1], counts[2]);
+
+	printf("%s\n", failures ? "FAILED" : "all passed");
+	return failures ? 1 : 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-n <inputs>] [-s <seed>] [corpus-dir]\n", argv[0]);
+	exit(1);
+}
@@ -0,0 +1,131 @@
+#include "pool.h"
+#include "hash.h"
+
+/*************************
+ * pconn_t static methods
+ *************************/
+
+static pconn_t *pconn_new(char *key, int fd)
+{
+	pconn_t *pconn = Malloc(sizeof(pconn_t));
+
+	pconn->fd = fd;
+	pconn->stamp = time(NULL);
+	pconn->key = strdup(key);
+	pconn->next = NULL;
+
+	return pconn;
+}
+
+static void pconn_delete(pconn_t *pconn)
+{
+	free(pconn->key);
+	free(pconn);
+}
+
+/* An idle connection is dead if the origin closed it or sent anything */
+static int pconn_alive(pconn_t *pconn)
+{
+	char c;
+
+	return recv(pconn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN;
+}
+
+/*************************
+ * pool_t static methods
+ *************************/
+
+static pconn_t **pool_bucket(pool_t *pool, char *key)
+{
+	return &pool->buckets[fnv1a(key) % POOL_BUCKETS];
+}
+
+/********************
+ * pool_t APIs
+ ********************/
+
+void pool_init(pool_t *pool, dns_t *dns)
+{
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->dns = dns;
+	memset(pool->buckets, 0, sizeof(pool->buckets));
+}
+
+/*
+ * Returns an idle connection to host:port if one is left, setting *reused,
+ * or a new one. Returns a negative value like open_clientfd on failure.
+ */
+int pool_get(pool_t *pool, char *host, char *port, int *reused)
+{
+	char key[MAXLINE];
+	pconn_t **link, *pconn, *found = NULL, *expired = NULL;
+	time_t now = time(NULL);
+	int fd;
+
+	snprintf(key, MAXLINE, "%s:%s", host, port);
+
+	pthread_mutex_lock(&pool->lock);
+	link = pool_bucket(pool, key);
+	while ((pconn = *link)) {
+		/* Drop connections idle for too long on the way */
+		if (now - pconn->stamp > POOL_TIMEOUT) {
+			*link = pconn->next;
+			pconn->next = expired;
+			expired = pconn;
+		}
+		else if (!found && !strcmp(pconn->key, key)) {
+			*link = pconn->next;
+			found = pconn;
+		}
+		else
+			link = &pconn->next;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	while ((pconn = expired)) {
+		expired = pconn->next;
+		close(pconn->fd);
+		pconn_delete(pconn);
+	}
+
+	if (found) {
+		fd = found->fd;
+		if (pconn_alive(found)) {
+			pconn_delete(found);
+			*reused = 1;
+			return fd;
+		}
+		close(fd);
+		pconn_delete(found);
+	}
+
+	*reused = 0;
+	return dns_connect(pool->dns, host, port);
+}
+
+/* Keeps a connection whose last response was read completely */
+void pool_put(pool_t *pool, char *host, char *port, int fd)
+{
+	char key[MAXLINE];
+	pconn_t **bucket, *pconn;
+	int nidle = 0;
+
+	snprintf(key, MAXLINE, "%s:%s", host, port);
+
+	pthread_mutex_lock(&pool->lock);
+	bucket = pool_bucket(pool, key);
+	for (pconn = *bucket; pconn; pconn = pconn->next)
+		if (!strcmp(pconn->key, key))
+			nidle++;
+
+	if (nidle < POOL_MAX_IDLE) {
+		pconn = pconn_new(key, fd);
+		pconn->next = *bucket;
+		*bucket = pconn;
+		fd = -1;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (fd >= 0)
+		close(fd);
+}
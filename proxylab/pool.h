@@ -0,0 +1,39 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "csapp.h"
+#include "dns.h"
+
+/* number of hash buckets for host:port keys */
+#define POOL_BUCKETS 64
+
+/* max idle connections kept per host:port */
+#define POOL_MAX_IDLE 8
+
+/* seconds an idle connection is kept */
+#define POOL_TIMEOUT 30
+
+/********************
+ * data structures
+ ********************/
+
+typedef struct __pconn {
+	int fd;
+	time_t stamp;		/* when it became idle */
+	char *key;		/* host:port */
+	struct __pconn *next;
+} pconn_t;
+
+/* idle upstream connections keyed by host:port */
+typedef struct {
+	pthread_mutex_t lock;
+	dns_t *dns;		/* resolves the origins of new connections */
+	pconn_t *buckets[POOL_BUCKETS];
+} pool_t;
+
+/* pool_t APIs */
+void pool_init(pool_t *pool, dns_t *dns);
+int pool_get(pool_t *pool, char *host, char *port, int *reused);
+void pool_put(pool_t *pool, char *host, char *port, int fd);
+
+#endif /* __POOL_H__ */
@@ -1,178 +1,1015 @@
-#define CACHE_ENABLED
+#include <limits.h>
+#include <sys/prctl.h>
 
-#include "csapp.h"
-#include "cache.h"
+#include "proxy.h"
+#include "sbuf.h"
+#include "pool.h"
+#include "flight.h"
+#include "event.h"
+#include "disk.h"
+#include "refresh.h"
+#include "relay.h"
+#include "http.h"
+
+/* default worker pool and connection queue sizes */
+#define NTHREADS 16
+#define SBUFSIZE 64
+
+/* most chunks of a cached object gathered into one write */
+#define SEND_IOVS 64
+
+/* seconds an idle keep-alive client may hold a worker */
+#define KEEPALIVE_TIMEOUT 5
+
+/* seconds a worker process must live for its successor to start at once */
+#define RESPAWN_DELAY 1
+
+/* request engine, as chosen on the command line */
+static int evented, nthreads, sbufsize = SBUFSIZE;
 
 #ifdef CACHE_ENABLED
 cache_t cache;
 #endif
 
+/* connected descriptors waiting for a worker */
+sbuf_t sbuf;
+
+/* idle upstream connections */
+pool_t pool;
+
+/* resolutions of upstream host:port pairs */
+dns_t resolver;
+
+/* access log, written to stdout off the request path */
+alog_t access_log;
+
+/* counters reported at STATS_PATH */
+stats_t stats;
+
+#ifdef CACHE_ENABLED
+/* misses being fetched from the origin */
+flights_t flights;
+
+/* stale objects being refreshed in the background */
+refresh_t refresher;
+#endif
+
+static void serve(int listenfd);
+static void supervise(int nworkers, char *port, char *snapshot);
 static void *handle_client(void *vargp);
-static void proxy(int client_fd);
-static int parse_uri(char *uri, char **host, char **port, char **path);
+#ifdef CACHE_ENABLED
+static void *snapshot_thread(void *vargp);
+static void refresh_object(char *uri);
+#endif
+static void shed_client(int client_fd);
+static int proxy(int client_fd, rio_t *client_rio);
 
 /* main routine */
 int main(int argc, char *argv[])
 {
-	int listenfd, *connfdp;
+	int i, c, nworkers = 0, policy = CACHE_LRU;
+	char *diskdir = NULL, *snapshot = NULL;
+	long capacity = MAX_CACHE_SIZE, max_object = MAX_OBJECT_SIZE;
+	sigset_t mask;
+	pthread_t tid;
+
+	while ((c = getopt(argc, argv, "ew:t:q:p:c:o:d:s:")) != -1) {
+		switch (c) {
+		case 'e':
+			evented = 1;
+			break;
+		case 'w':
+			nworkers = atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'q':
+			sbufsize = atoi(optarg);
+			break;
+		case 'p':
+			if ((policy = cache_policy(optarg)) < 0)
+				goto usage;
+			break;
+		case 'c':
+			if ((capacity = cache_parse_size(optarg)) < 0)
+				goto usage;
+			break;
+		case 'o':
+			if ((max_object = cache_parse_size(optarg)) < 0 || max_object > INT_MAX)
+				goto usage;
+			break;
+		case 'd':
+			diskdir = optarg;
+			break;
+		case 's':
+			snapshot = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	/* The disk tier is private to a process */
+	if (optind != argc - 1 || nthreads < 0 || sbufsize < 1 || nworkers < 0
+	    || (nworkers && diskdir))
+		goto usage;
+
+#ifdef CACHE_ENABLED
+	/* Worker processes share the cache through memory mapped before they fork */
+	cache_init(&cache, policy, capacity, max_object, nworkers > 0);
+
+	/* Warm restart; snapshots are taken on SIGUSR1 and SIGTERM */
+	if (snapshot && (i = cache_load(&cache, snapshot)) >= 0)
+		fprintf(stderr, "restored %d objects from %s\n", i, snapshot);
+
+	if (diskdir)
+		cache.disk = disk_open(diskdir);
+#endif
+
+	/* A client or origin hanging up must not kill the proxy */
+	Signal(SIGPIPE, SIG_IGN);
+
+	if (nworkers)
+		supervise(nworkers, argv[optind], snapshot);
+
+#ifdef CACHE_ENABLED
+	if (snapshot) {
+		Sigemptyset(&mask);
+		Sigaddset(&mask, SIGUSR1);
+		Sigaddset(&mask, SIGTERM);
+		Sigprocmask(SIG_BLOCK, &mask, NULL);
+		Pthread_create(&tid, NULL, snapshot_thread, snapshot);
+	}
+#endif
+
+	serve(Open_listenfd(argv[optind]));
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-e] [-w <workers>] [-t <threads>] [-q <queue>] [-p lru|tinylfu] [-c <bytes>] [-o <bytes>] [-d <dir>] [-s <snapshot>] <port>\n", argv[0]);
+	exit(1);
+}
+
+/*
+ * Runs the request engine of a process on listenfd; everything here
+ * starts threads, so a worker process calls it only once forked
+ */
+static void serve(int listenfd)
+{
 	socklen_t clientlen;
 	struct sockaddr_storage clientaddr;
 	pthread_t tid;
+	int connfd, i;
+
+#ifdef CACHE_ENABLED
+	flights_init(&flights);
+	refresh_init(&refresher, REFRESH_THREADS, REFRESH_QUEUE, refresh_object);
+#endif
+	alog_init(&access_log, STDOUT_FILENO);
+#ifdef CACHE_ENABLED
+	stats_init(&stats, &cache);
+#else
+	stats_init(&stats, NULL);
+#endif
+	dns_init(&resolver, NULL);
+	pool_init(&pool, &resolver);
+
+	/* Event-driven engine: one event loop per core by default */
+	if (evented) {
+		if (!nthreads)
+			nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		event_run(listenfd, nthreads);
+		return;
+	}
+	if (!nthreads)
+		nthreads = NTHREADS;
+
+	/* Prethread the worker pool */
+	sbuf_init(&sbuf, sbufsize);
+	for (i = 0; i < nthreads; i++)
+		Pthread_create(&tid, NULL, handle_client, NULL);
+
+	while (1) {
+		clientlen = sizeof(clientaddr);
+		connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+
+		/* Shed load rather than queueing without bound */
+		if (sbuf_tryinsert(&sbuf, connfd) < 0)
+			shed_client(connfd);
+	}
+}
+
+/* Forks a worker process, which listens on port itself and never returns */
+static pid_t spawn_worker(char *port, sigset_t *mask)
+{
+	pid_t pid, master = getpid();
+
+	if ((pid = Fork()))
+		return pid;
 
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-		exit(1);
+	/* Workers go down with the master */
+	Sigprocmask(SIG_SETMASK, mask, NULL);
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid() != master)
+		exit(0);
+
+	serve(Open_reuseport_listenfd(port));
+	exit(0);
+}
+
+/*
+ * The master process of -w: forks the workers, which bind the port
+ * each with SO_REUSEPORT so that the kernel balances accepts across
+ * them, and forks a new one whenever one dies. Only connections go
+ * down with a worker; the cache lives on in shared memory. The master
+ * takes the snapshots, SIGTERM also stopping the workers.
+ */
+static void supervise(int nworkers, char *port, char *snapshot)
+{
+	pid_t *pids = Calloc(nworkers, sizeof(pid_t)), pid;
+	time_t *born = Calloc(nworkers, sizeof(time_t));
+	sigset_t mask, prev;
+	int i, sig, status;
+
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGCHLD);
+	Sigaddset(&mask, SIGUSR1);
+	Sigaddset(&mask, SIGTERM);
+	Sigprocmask(SIG_BLOCK, &mask, &prev);
+
+	for (i = 0; i < nworkers; i++) {
+		pids[i] = spawn_worker(port, &prev);
+		born[i] = time(NULL);
 	}
 
+	while (1) {
+		if (sigwait(&mask, &sig))
+			continue;
+
 #ifdef CACHE_ENABLED
-	cache_init(&cache);
+		if (sig != SIGCHLD && snapshot && cache_save(&cache, snapshot) < 0)
+			fprintf(stderr, "snapshot to %s failed\n", snapshot);
 #endif
+		if (sig == SIGTERM) {
+			for (i = 0; i < nworkers; i++)
+				kill(pids[i], SIGTERM);
+			exit(0);
+		}
+		if (sig != SIGCHLD)
+			continue;
+
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (i = 0; i < nworkers && pids[i] != pid; i++)
+				;
+			if (i == nworkers)
+				continue;
+
+			if (WIFSIGNALED(status))
+				fprintf(stderr, "worker %d killed by signal %d\n", pid, WTERMSIG(status));
+			else
+				fprintf(stderr, "worker %d exited with status %d\n", pid, WEXITSTATUS(status));
+
+			/* Do not spin on a worker that dies as it starts */
+			if (time(NULL) - born[i] < RESPAWN_DELAY)
+				sleep(RESPAWN_DELAY);
+			pids[i] = spawn_worker(port, &prev);
+			born[i] = time(NULL);
+		}
+	}
+}
+
+#ifdef CACHE_ENABLED
+/*
+ * Every other thread blocks SIGUSR1 and SIGTERM, so this one takes them
+ * synchronously and may do anything with the cache.
+ */
+static void *snapshot_thread(void *vargp)
+{
+	char *path = vargp;
+	sigset_t mask;
+	int sig;
+
+	Pthread_detach(Pthread_self());
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGUSR1);
+	Sigaddset(&mask, SIGTERM);
 
-	/* listening socket */
-	listenfd = Open_listenfd(argv[1]);
 	while (1) {
-		clientlen = sizeof(clientaddr);
-		connfdp = Malloc(sizeof(int));
-		*connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-		Pthread_create(&tid, NULL, handle_client, connfdp);
+		if (sigwait(&mask, &sig))
+			continue;
+		if (cache_save(&cache, path) < 0)
+			fprintf(stderr, "snapshot to %s failed\n", path);
+		if (sig == SIGTERM)
+			exit(0);
 	}
 
-	return 0;
+	return NULL;
 }
+#endif
 
-/* client-side thread */
+/* worker thread */
 void *handle_client(void *vargp)
 {
-	int connfd = *((int *)vargp);
+	struct timeval timeout = { KEEPALIVE_TIMEOUT, 0 };
+	rio_t rio;
+	int connfd;
+
 	Pthread_detach(Pthread_self());
-	Free(vargp);
-	proxy(connfd);
-	Close(connfd);
+	while (1) {
+		connfd = sbuf_remove(&sbuf);
+		stats_add(&stats, STATS_CONNECTIONS, 1);
+
+		/* Serve requests until the client closes or idles too long */
+		setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		rio_readinitb(&rio, connfd);
+		while (proxy(connfd, &rio))
+			;
+		Close(connfd);
+		stats_add(&stats, STATS_CONNECTIONS, -1);
+	}
 	return NULL;
 }
 
-/* proxy */
-void proxy(int client_fd)
+/* reject a connection while every worker is busy and the queue is full */
+void shed_client(int client_fd)
 {
-	rio_t client_rio, server_rio;
-	char buf[MAXBUF], method[16], uri[MAXURI], ver[16], type[32];
-	char *host, *port, *path, *temp;
-	int server_fd, stat_code;
-	ssize_t n, sum;
-	
+	static char *resp = "HTTP/1.0 503 Service Unavailable\r\n"
+			    "Content-Length: 0\r\n"
+			    "Connection: close\r\n\r\n";
+
+	rio_writen(client_fd, resp, strlen(resp));
+	Close(client_fd);
+}
+
+/*
+ * write the pending iovecs and then n bytes at p, if any, with a single
+ * gathered write; the pending iovecs are cleared
+ */
+static int send_block(int fd, struct iovec *iov, int *niov, char *p, long n)
+{
+	int cnt = *niov;
+
+	if (n > 0) {
+		iov[cnt].iov_base = p;
+		iov[cnt++].iov_len = n;
+	}
+	*niov = 0;
+	return cnt && rio_writev(fd, iov, cnt) < 0 ? -1 : 0;
+}
+
+/*
+ * write the pending iovecs and then n bytes of a cached object from
+ * offset off, gathering up to SEND_IOVS chunks a write
+ */
+static int send_chunks(int fd, struct iovec *iov, int *niov, obj_t *obj, long off, long n)
+{
+	struct iovec vec[SEND_IOVS];
+	int cnt = *niov;
+
+	memcpy(vec, iov, cnt * sizeof(struct iovec));
+	*niov = 0;
+	while (1) {
+		cnt += obj_iov(obj, &off, &n, vec + cnt, SEND_IOVS - cnt);
+		if (cnt && rio_writev(fd, vec, cnt) < 0)
+			return -1;
+		if (!cnt || n <= 0)
+			return 0;
+		cnt = 0;
+	}
+}
+
+/* send a cached object, announcing whether the connection persists */
+static int send_object(int fd, obj_t *obj, int keep)
+{
+	int hdrsize = http_header_size(obj->data, obj->len), niov = 2, n = 0;
+	char conn[64], value[32];
+	struct iovec iov[2];
+
+	if (hdrsize < 0) {
+		niov = 0;
+		return send_chunks(fd, iov, &niov, obj, 0, obj->size);
+	}
+
+	/*
+	 * Splice the Connection header in before the blank line; a body that
+	 * ran to EOF upstream needs a length for the connection to persist
+	 */
+	if (keep && http_header_value(obj->data, obj->len, "Content-Length:", value, sizeof(value)))
+		n = sprintf(conn, "Content-Length: %d\r\n", obj->size - hdrsize - 2);
+	sprintf(conn + n, "Connection: %s\r\n", keep ? "keep-alive" : "close");
+	iov[0].iov_base = obj->data;
+	iov[0].iov_len = hdrsize;
+	iov[1].iov_base = conn;
+	iov[1].iov_len = strlen(conn);
+	return send_chunks(fd, iov, &niov, obj, hdrsize, obj->size - hdrsize);
+}
+
 #ifdef CACHE_ENABLED
-	char cache_key[MAXURI];
-	buf_t cache_buf;
-	int cache_buf_failed = 0;
-#endif
+/* append the conditional headers that revalidate a cached object */
+static int add_validators(char *req, int reqlen, obj_t *obj)
+{
+	char value[256];
 
-	/* Get a request */
-	Rio_readinitb(&client_rio, client_fd);
-	if (!Rio_readlineb(&client_rio, buf, MAXBUF))
-		return;
+	if (!http_header_value(obj->data, obj->len, "ETag:", value, sizeof(value)) &&
+	    reqlen + strlen(value) + 43 < MAXBUF)
+		reqlen += sprintf(req + reqlen, "If-None-Match: %s\r\n", value);
+	if (!http_header_value(obj->data, obj->len, "Last-Modified:", value, sizeof(value)) &&
+	    reqlen + strlen(value) + 47 < MAXBUF)
+		reqlen += sprintf(req + reqlen, "If-Modified-Since: %s\r\n", value);
+
+	return reqlen;
+}
+
+/* read the rest of a 304 response and extend the freshness of the object */
+static void not_modified(char *uri, rio_t *rio, int keep, char *host, char *port)
+{
+	char buf[MAXBUF];
+	fresh_t fresh;
+	ssize_t n;
+
+	http_fresh_init(&fresh);
+	while ((n = rio_readlineb(rio, buf, MAXBUF)) > 0 && strncmp(buf, "\r\n", 2)) {
+		if (http_hop_header(buf) && http_has_token(buf, "close"))
+			keep = 0;
+		http_fresh_header(&fresh, buf);
+	}
+
+	if (n > 0 && keep)
+		pool_put(&pool, host, port, rio->rio_fd);
+	else
+		Close(rio->rio_fd);
+	if (fresh.cacheable)
+		cache_refresh(&cache, uri, http_fresh_expiry(&fresh, time(NULL)));
+}
+
+/*
+ * Serving a stale object is fine within the grace window, as long as
+ * one refresh of it is under way; returns 1 if the caller may
+ */
+int refresh_stale(char *uri, time_t expires)
+{
+	if (expires + CACHE_GRACE <= time(NULL))
+		return 0;
+
+	if (flight_trybegin(&flights, uri) && refresh_submit(&refresher, uri) < 0)
+		flight_end(&flights, uri);
+	return 1;
+}
 
-	/* Read the request line */
-	sscanf(buf, "%s %s %s", method, uri, ver);
+/* refresh thread job: revalidate or refetch a stale object */
+static void refresh_object(char *uri)
+{
+	struct timeval timeout = { REFRESH_TIMEOUT, 0 };
+	char key[MAXURI], host[MAXURI], port[MAXURI], path[MAXURI], req[MAXBUF], buf[MAXBUF];
+	char ver[16];
+	int server_fd, reused, reqlen, stat_code = 0, server_keep, failed = 0;
+	ssize_t n, sum, len = -1;
+	buf_t *cache_buf = NULL;
+	fresh_t fresh;
+	obj_t *stale;
+	rio_t rio;
+
+	strcpy(key, uri);
+	if (http_split_uri(uri, host, port, path, MAXURI) ||
+	    !(stale = cache_read(&cache, key, NULL)))
+		goto out;
+
+	reqlen = snprintf(req, MAXBUF, "GET /%s HTTP/1.0\r\nHost: %s:%s\r\n", path, host, port);
+	reqlen = add_validators(req, reqlen, stale);
+	reqlen += sprintf(req + reqlen, "Connection: keep-alive\r\n\r\n");
+	obj_release(stale);
+
+	do {
+		if ((server_fd = pool_get(&pool, host, port, &reused)) < 0)
+			goto out;
+		setsockopt(server_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		rio_readinitb(&rio, server_fd);
+		if (rio_writen(server_fd, req, reqlen) == reqlen &&
+		    (n = rio_readlineb(&rio, buf, MAXBUF)) > 0)
+			break;
+		Close(server_fd);
+		if (!reused)
+			goto out;
+	} while (1);
+
+	sscanf(buf, "%15s %d", ver, &stat_code);
+	server_keep = !strcasecmp(ver, "HTTP/1.1");
+
+	if (stat_code == 304) {
+		not_modified(key, &rio, server_keep, host, port);
+		goto out;
+	}
+
+	/* Collect a new version, leaving out the hop-by-hop headers */
+	http_fresh_init(&fresh);
+	cache_buf = buf_new(&cache);
+	do {
+		if (!strncmp(buf, "\r\n", 2))
+			break;
+		if (http_hop_header(buf)) {
+			if (http_has_token(buf, "close"))
+				server_keep = 0;
+			continue;
+		}
+		if (buf_fill(cache_buf, buf, n) < 0)
+			failed = 1;
+		if (!strncasecmp(buf, "Content-Length:", 15))
+			len = atol(buf + 15);
+		http_fresh_header(&fresh, buf);
+	} while ((n = rio_readlineb(&rio, buf, MAXBUF)) > 0);
+
+	if (n <= 0 || buf_fill(cache_buf, "\r\n", 2) < 0) {
+		Close(server_fd);
+		goto out;
+	}
+
+	for (sum = 0; !failed && (len < 0 || sum < len); sum += n) {
+		n = (len < 0 || len - sum > MAXBUF) ? MAXBUF : len - sum;
+		if ((n = rio_readnb(&rio, buf, n)) <= 0)
+			break;
+		if (buf_fill(cache_buf, buf, n) < 0)
+			failed = 1;
+	}
+
+	if (!failed && server_keep && len >= 0 && sum == len)
+		pool_put(&pool, host, port, server_fd);
+	else
+		Close(server_fd);
+
+	if (!failed && (len < 0 || sum == len) && stat_code == 200 && fresh.cacheable)
+		cache_write(&cache, key, cache_buf, http_fresh_expiry(&fresh, time(NULL)));
+
+out:
+	buf_delete(cache_buf);
+	flight_end(&flights, key);
+}
+#endif
 
 #ifdef CACHE_ENABLED
-	/* Read the corresponding data from the cache if it exists */
-	strncpy(cache_key, uri, strlen(uri));
-	buf_clear(&cache_buf);
-	if ((n = cache_read(&cache, cache_key, &cache_buf)) >= 0) {
-		Rio_writen(client_fd, cache_buf.buf, n);
-		sum = n;
-		return;
+/* does the If-Range validator, if any, match the cached header block */
+static int range_applies(char *data, int size, char *ifrange)
+{
+	char value[256];
+
+	if (!*ifrange)
+		return 1;
+	if (!strncmp(ifrange, "W/", 2))
+		return 0;	/* weak validators never match */
+
+	return (!http_header_value(data, size, "ETag:", value, sizeof(value)) &&
+		!strcmp(value, ifrange)) ||
+	       (!http_header_value(data, size, "Last-Modified:", value, sizeof(value)) &&
+		!strcmp(value, ifrange));
+}
+
+/*
+ * build in head (MAXBUF bytes) the head of a 206 answer for bytes
+ * first-last of a body of total bytes, or of a 416 answer if slice < 0,
+ * from a cached header block; returns its length or -1
+ */
+static int range_head(char *head, char *data, int size, int slice,
+		      long first, long last, long total, int keep)
+{
+	char ver[16] = "HTTP/1.0";
+	int hdrsize = http_header_size(data, size), n;
+	char *line, *eol, *end = data + hdrsize;
+
+	if (hdrsize < 0 || !(eol = memchr(data, '\n', hdrsize)))
+		return -1;
+
+	/* Keep the version of the status line, replace the rest */
+	sscanf(data, "%15s", ver);
+	n = sprintf(head, "%s %s\r\n", ver,
+		    slice < 0 ? "416 Range Not Satisfiable" : "206 Partial Content");
+
+	for (line = eol + 1; line < end && (eol = memchr(line, '\n', end - line)); line = eol + 1) {
+		if (!strncasecmp(line, "Content-Length:", 15))
+			continue;
+		if (n + (eol + 1 - line) + 128 >= MAXBUF)
+			return -1;
+		memcpy(head + n, line, eol + 1 - line);
+		n += eol + 1 - line;
 	}
+
+	if (slice < 0)
+		n += sprintf(head + n, "Content-Range: bytes */%ld\r\nContent-Length: 0\r\n", total);
+	else
+		n += sprintf(head + n, "Content-Range: bytes %ld-%ld/%ld\r\nContent-Length: %ld\r\n",
+			     first, last, total, last - first + 1);
+	n += sprintf(head + n, "Connection: %s\r\n\r\n", keep ? "keep-alive" : "close");
+
+	return n;
+}
+
+/*
+ * send a cached object, or the slice of its body a Range header asks for,
+ * noting the status and body bytes of the answer in rec
+ */
+static int send_cached(int fd, obj_t *obj, char *range, char *ifrange, int keep,
+		       alogrec_t *rec)
+{
+	int hdrsize = http_header_size(obj->data, obj->len), slice, n, niov = 1;
+	long first, last, total = obj->size - hdrsize - 2;
+	char head[MAXBUF];
+	struct iovec iov[2];
+
+	/* Only complete 200 responses are cached */
+	rec->status = 200;
+	rec->bytes = hdrsize < 0 ? obj->size : total;
+	if (!*range || hdrsize < 0 || !range_applies(obj->data, obj->len, ifrange) ||
+	    !(slice = http_range(range, total, &first, &last)))
+		return send_object(fd, obj, keep);
+
+	/* A head too large to rewrite goes out whole with the full body */
+	if ((n = range_head(head, obj->data, obj->len, slice, first, last, total, keep)) < 0)
+		return send_object(fd, obj, keep);
+	iov[0].iov_base = head;
+	iov[0].iov_len = n;
+	rec->status = slice < 0 ? 416 : 206;
+	rec->bytes = slice < 0 ? 0 : last - first + 1;
+	if (slice < 0)
+		return send_block(fd, iov, &niov, NULL, 0);
+	return send_chunks(fd, iov, &niov, obj, hdrsize + 2 + first, last - first + 1);
+}
 #endif
 
-	/* Parse the request line */
-	if (parse_uri(uri, &host, &port, &path))
-		return;
+/*
+ * write the pending iovecs and the part of a block at offset off of a
+ * body that lies in first-last
+ */
+static int send_slice(int fd, struct iovec *iov, int *niov, char *buf,
+		      long off, long n, long first, long last)
+{
+	long from = off > first ? off : first, to = off + n - 1 < last ? off + n - 1 : last;
+
+	if (from > to)
+		return send_block(fd, iov, niov, NULL, 0);
+	return send_block(fd, iov, niov, buf + from - off, to - from + 1);
+}
+
+/* proxy - serve one request; returns 1 if the client connection persists */
+int proxy(int client_fd, rio_t *client_rio)
+{
+	rio_t server_rio;
+	char buf[MAXBUF], hdrs[MAXBUF], req[MAXBUF], head[MAXBUF + 2];
+	char ver[16];
+	char *host, *port, *conn, *line;
+	request_t rq;
+	header_t *h, hdr;
+	alogrec_t rec;
+	struct timespec upstart;
+	struct iovec iov[3];
+	int server_fd, stat_code = 0, reused, reqlen, hdrlen = 0, headlen = 0, niov, i;
+	int client_keep, server_keep, keep, rc = 0, ranged = 0, slice = 0, relayed, err;
+	ssize_t n, sum = 0, len = -1;
+	long first = 0, last = -1;
+	
+#ifdef CACHE_ENABLED
+	char cache_key[MAXURI], range[128] = "", ifrange[256] = "";
+	buf_t *cache_buf;
+	obj_t *obj, *stale = NULL;
+	fresh_t fresh;
+	time_t expires;
+	int cache_buf_failed = 0, leader = 0;
+#endif
+
+	/* Read the request head, up to the empty line, and parse it in one pass */
+	do {
+		if ((n = rio_readlineb(client_rio, hdrs + hdrlen, MAXBUF - hdrlen)) <= 0)
+			return 0;
+		hdrlen += n;
+	} while (hdrlen < MAXBUF - 1 && strcmp(hdrs + hdrlen - n, "\r\n") &&
+		 strcmp(hdrs + hdrlen - n, "\n"));
+	if (http_parse_request(hdrs, hdrlen, &rq) != hdrlen || rq.uri.len >= MAXURI)
+		return 0;
+	alog_begin(&rec, rq.method.ptr, rq.method.len, rq.uri.ptr, rq.uri.len);
 
-	/* Connect to the server */
-	server_fd = Open_clientfd(host, port);
-	Rio_readinitb(&server_rio, server_fd);
+	/* HTTP/1.1 clients persist unless they ask otherwise */
+	client_keep = http_slice_eq(rq.version, "HTTP/1.1");
+
+	/* Build the request, leaving out the hop-by-hop headers */
+	reqlen = snprintf(req, MAXBUF, "GET /%.*s HTTP/1.0\r\n", rq.path.len, rq.path.ptr);
+	for (i = 0; i < rq.nheaders; i++) {
+		h = &rq.headers[i];
+		switch (h->id) {
+		case HTTP_CONNECTION:
+		case HTTP_KEEP_ALIVE:
+		case HTTP_PROXY_CONNECTION:
+			if (http_slice_has(h->value, "close"))
+				client_keep = 0;
+			else if (http_slice_has(h->value, "keep-alive"))
+				client_keep = 1;
+			break;
+		case HTTP_IF_MODIFIED_SINCE:
+		case HTTP_IF_NONE_MATCH:
+			break;		/* answered with a full, cacheable response */
+#ifdef CACHE_ENABLED
+		/* Ranges are cut out of full responses, never forwarded */
+		case HTTP_RANGE:
+			snprintf(range, sizeof(range), "%.*s", h->value.len, h->value.ptr);
+			break;
+		case HTTP_IF_RANGE:
+			snprintf(ifrange, sizeof(ifrange), "%.*s", h->value.len, h->value.ptr);
+			break;
+#endif
+		default:
+			if (reqlen + h->line.len < MAXBUF) {
+				memcpy(req + reqlen, h->line.ptr, h->line.len);
+				reqlen += h->line.len;
+			}
+		}
+	}
 
-	printf("%s %s\n", method, uri);
+	/* The proxy answers for itself at STATS_PATH */
+	if (!rq.host.len && (i = stats_match(rq.uri.ptr, rq.uri.len)) >= 0) {
+		if ((n = stats_response(&stats, i, client_keep, buf, MAXBUF)) > 0 &&
+		    rio_writen(client_fd, buf, n) == n) {
+			rec.status = 200;
+			rc = client_keep;
+		}
+		goto out;
+	}
+
+#ifdef CACHE_ENABLED
+	/*
+	 * Send a fresh object straight from the cache, and a stale one while
+	 * it is refreshed in the background; past the grace window revalidate
+	 */
+	memcpy(cache_key, rq.uri.ptr, rq.uri.len);
+	cache_key[rq.uri.len] = '\0';
+	ranged = range[0] != '\0';
+	if ((obj = cache_read(&cache, cache_key, &expires))) {
+		if (expires <= time(NULL) && !refresh_stale(cache_key, expires))
+			stale = obj;
+		else {
+			rec.cache = expires <= time(NULL) ? ALOG_STALE : ALOG_HIT;
+			n = send_cached(client_fd, obj, range, ifrange, client_keep, &rec);
+			obj_release(obj);
+			rc = !n && client_keep;
+			goto out;
+		}
+	}
+#endif
 
 	/* Support only "GET" method */
-	if (strncasecmp(method, "GET", 3)) {
-		/* TODO: body */
-		sprintf(buf, "%d %s %s\r\n", 501, "Not Implemented", ver);
-		Rio_writen(client_fd, buf, MAXBUF);
-		printf("  ← %d %s %d\n", 501, "text/html", 0);
-		return;
+	if (!http_slice_eq(rq.method, "GET")) {
+		sprintf(buf, "%s %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+			"HTTP/1.0", 501, "Not Implemented");
+		rio_writen(client_fd, buf, strlen(buf));
+		rec.status = 501;
+		goto out;
 	}
 
-	/* Forward the request line */
-	sprintf(buf, "GET /%s %s\r\n", path, ver);
-	Rio_writen(server_fd, buf, strlen(buf));
+	/* Only absolute http:// URIs name an origin */
+	if (!rq.host.len)
+		goto out;
+	host = http_slice_str(rq.host);
+	port = rq.port.len ? http_slice_str(rq.port) : "80";
 
-	/* Forward the request headers */
-	while ((n = Rio_readlineb(&client_rio, buf, MAXBUF))) {
-		Rio_writen(server_fd, buf, strlen(buf));
-		if (!strncmp(buf, "\r\n", 2))
+#ifdef CACHE_ENABLED
+	/* Let only the first of concurrent misses go to the origin */
+	if (!(leader = flight_begin(&flights, cache_key)) &&
+	    (obj = cache_read(&cache, cache_key, NULL))) {
+		rec.cache = ALOG_HIT;
+		n = send_cached(client_fd, obj, range, ifrange, client_keep, &rec);
+		obj_release(obj);
+		rc = !n && client_keep;
+		goto out;
+	}
+#endif
+
+#ifdef CACHE_ENABLED
+	/* Revalidate a stale object with its validators */
+	if (stale)
+		reqlen = add_validators(req, reqlen, stale);
+#endif
+
+	/* Ask the origin to keep the connection open */
+	if (reqlen + 26 >= MAXBUF)
+		goto out;
+	reqlen += sprintf(req + reqlen, "Connection: keep-alive\r\n\r\n");
+
+	/* Send it over a pooled connection or a new one */
+	clock_gettime(CLOCK_MONOTONIC, &upstart);
+	do {
+		if ((server_fd = pool_get(&pool, host, port, &reused)) < 0)
+			goto unreachable;
+		rio_readinitb(&server_rio, server_fd);
+		if (rio_writen(server_fd, req, reqlen) == reqlen &&
+		    (n = rio_readlineb(&server_rio, buf, MAXBUF)) > 0)
 			break;
+
+		/* The origin may have closed a pooled connection meanwhile */
+		Close(server_fd);
+		if (!reused)
+			goto unreachable;
+	} while (1);
+
+	stats_upstream(&stats, &upstart);
+	sscanf(buf, "%15s %d", ver, &stat_code);
+	server_keep = !strcasecmp(ver, "HTTP/1.1");
+	rec.status = stat_code;
+
+#ifdef CACHE_ENABLED
+	http_fresh_init(&fresh);
+
+	/* Not modified: refresh the stale object instead of downloading it */
+	if (stale && stat_code == 304) {
+		not_modified(cache_key, &server_rio, server_keep, host, port);
+		rec.cache = ALOG_REVALIDATED;
+		rc = !send_cached(client_fd, stale, range, ifrange, client_keep, &rec) && client_keep;
+		goto out;
 	}
 
-	/* Forward the response */
-	while ((n = Rio_readlineb(&server_rio, buf, MAXBUF))) {
-		Rio_writen(client_fd, buf, n);
-		if (!strncmp(buf, "HTTP", 4))
-			sscanf(buf, "%s %d", ver, &stat_code);
-		else if (!strncmp(buf, "Content-Type", 12)) {
-			strtok(buf, " ");
-			temp = strtok(NULL, " ");
-			strtok(temp, "\r");
-			strtok(temp, ";");
-			strncpy(type, temp, strlen(temp));
-		}
-		else if (!strncmp(buf, "\r\n", 2))
+	/* Only a miss needs a buffer to collect the object */
+	rec.cache = ALOG_MISS;
+	cache_buf = buf_new(&cache);
+#endif
+
+	/*
+	 * Collect the response headers, leaving out the hop-by-hop ones, to
+	 * go out with the body; the answer to a range request is built once
+	 * they are all in. Lines after the status line are taken straight
+	 * out of the rio buffer and copied once, into head
+	 */
+	line = buf;
+	do {
+		if (n == 2 && !memcmp(line, "\r\n", 2))
 			break;
+
+		/* A line that does not parse is passed on as it is */
+		if (http_parse_header(line, n, &hdr) <= 0)
+			hdr.id = HTTP_OTHER;
+
+		if (hdr.id == HTTP_CONNECTION || hdr.id == HTTP_KEEP_ALIVE ||
+		    hdr.id == HTTP_PROXY_CONNECTION) {
+			if (http_slice_has(hdr.value, "close"))
+				server_keep = 0;
+			else if (http_slice_has(hdr.value, "keep-alive"))
+				server_keep = 1;
+			continue;
+		}
+
+		/*
+		 * Flush a header block too large to hold; a range answer needs
+		 * all of it, so it goes out whole. head has room past MAXBUF
+		 * for a NUL or the empty line
+		 */
+		if (headlen + n > MAXBUF) {
+			if (rio_writen(client_fd, head, headlen) < 0)
+				goto fail;
+			headlen = 0;
+			ranged = 0;
+		}
+		memcpy(head + headlen, line, n);
+		head[headlen + n] = '\0';
+
+#ifdef CACHE_ENABLED
+		/* Cache the response headers along with the body */
+		if (buf_fill(cache_buf, line, n) < 0)
+			cache_buf_failed = 1;
+		http_fresh_header(&fresh, head + headlen);
+#endif
+		headlen += n;
+
+		if (hdr.id == HTTP_CONTENT_LENGTH)
+			len = atol(hdr.value.ptr);
+	} while ((n = rio_readlinep(&server_rio, &line)) > 0);
+
+	if (n <= 0)
+		goto fail;
+
+	/* Only a delimited response lets the client connection persist */
+	keep = client_keep && len >= 0;
+
+	/* The head goes out in one gathered write with the first body block */
+	conn = keep ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+	iov[0].iov_base = head;
+	iov[0].iov_len = headlen;
+	iov[1].iov_base = conn;
+	iov[1].iov_len = strlen(conn);
+	niov = 2;
+
+#ifdef CACHE_ENABLED
+	if (buf_fill(cache_buf, "\r\n", 2) < 0)
+		cache_buf_failed = 1;
+
+	/*
+	 * Cut the range out of a full response, which is cached as usual; the
+	 * head of its answer is built in req, spent once sent, and a head too
+	 * large to rewrite leaves the response to go out whole
+	 */
+	if (ranged) {
+		memcpy(head + headlen, "\r\n", 2);
+		if (stat_code == 200 && len >= 0 && range_applies(head, headlen + 2, ifrange))
+			slice = http_range(range, len, &first, &last);
+		if (slice && (i = range_head(req, head, headlen + 2, slice,
+					     first, last, len, keep)) >= 0) {
+			iov[0].iov_base = req;
+			iov[0].iov_len = i;
+			niov = 1;
+		}
+		else
+			slice = 0;
 	}
-	sum = 0;
-	while ((n = Rio_readlineb(&server_rio, buf, MAXBUF))) {
-		Rio_writen(client_fd, buf, n);
+#endif
+
+	/*
+	 * A large body that is not going to be cached is spliced from socket
+	 * to socket; the bytes rio has buffered already go out with the head
+	 */
+	relayed = !slice && (len < 0 || len > RELAY_MIN_SIZE);
+#ifdef CACHE_ENABLED
+	if (!cache_buf_failed && stat_code == 200 && fresh.cacheable && len <= cache.max_object)
+		relayed = 0;
+#endif
+	if (relayed) {
+		n = (len >= 0 && server_rio.rio_cnt > len) ? len : server_rio.rio_cnt;
+		if (send_block(client_fd, iov, &niov, server_rio.rio_bufptr, n) < 0)
+			goto fail;
+		server_rio.rio_bufptr += n;
+		server_rio.rio_cnt -= n;
+		sum = n;
+
+		if ((err = relay_body(server_fd, client_fd, len < 0 ? -1 : len - sum, &n)) == -1)
+			goto fail;
 		sum += n;
+		relayed = err != RELAY_UNSUPPORTED;
+#ifdef CACHE_ENABLED
+		cache_buf_failed = 1;	/* the body bypassed the buffer */
+#endif
+	}
+
+	/* Otherwise forward the body in blocks, up to Content-Length or EOF */
+	for (; !relayed && (len < 0 || sum < len); sum += n) {
+		n = (len < 0 || len - sum > MAXBUF) ? MAXBUF : len - sum;
+		if ((n = rio_readnb(&server_rio, buf, n)) <= 0)
+			break;
+		if (slice > 0 && send_slice(client_fd, iov, &niov, buf, sum, n, first, last) < 0)
+			goto fail;
+		if (!slice && send_block(client_fd, iov, &niov, buf, n) < 0)
+			goto fail;
 
 #ifdef CACHE_ENABLED
 		/* Do not cache the data
 		   if the cache buffer is too small to store the data */
-		if (buf_fill(&cache_buf, buf, n) < 0)
+		if (buf_fill(cache_buf, buf, n) < 0)
 			cache_buf_failed = 1;
 #endif
 	}
 
-#ifdef CACHE_ENABLED
-	/* Store the data to the cache buffer */
-	if (!cache_buf_failed)
-		cache_write(&cache, cache_key, &cache_buf);
-#endif
-
-	printf("  ← %d %s %ld\n", stat_code, type, sum);
-}
+	/* An empty body or a 416 answer leaves the head unsent */
+	if (send_block(client_fd, iov, &niov, NULL, 0) < 0)
+		goto fail;
 
-/* URI parser */
-int parse_uri(char *uri, char **host, char **port, char **path)
-{
-	char *scheme = "http://";
-	static char *http_wkport = "80";
+	/* A fully read response leaves the origin connection reusable */
+	if (server_keep && len >= 0 && sum == len)
+		pool_put(&pool, host, port, server_fd);
+	else
+		Close(server_fd);
 
-	if (strncasecmp(uri, scheme, strlen(scheme)))
-		return 1;
+#ifdef CACHE_ENABLED
+	/* Store a complete, cacheable response */
+	if (!cache_buf_failed && (len < 0 || sum == len) &&
+	    stat_code == 200 && fresh.cacheable)
+		cache_write(&cache, cache_key, cache_buf, http_fresh_expiry(&fresh, time(NULL)));
+	buf_delete(cache_buf);
+#endif
 
-	/* host */
-	*host = uri + strlen(scheme);
+	/* A range answer has a status of its own and only the slice as body */
+	if (slice)
+		rec.status = slice < 0 ? 416 : 206;
+	rec.bytes = slice > 0 ? last - first + 1 : slice < 0 ? 0 : sum;
+	rc = keep && sum == len;
+	goto out;
 
-	/* path */
-	strtok(*host, "/");
-	*path = *host + strlen(*host) + 1;
+fail:
+	rec.bytes = sum;
+	Close(server_fd);
+#ifdef CACHE_ENABLED
+	buf_delete(cache_buf);
+#endif
+	goto out;
 
-	/* port */
-	strtok(*host, ":");
-	if (!(*port = strtok(NULL, ":")))
-		*port = http_wkport;
+unreachable:
+#ifdef CACHE_ENABLED
+	/* A stale object beats no object at all */
+	if (stale) {
+		rec.cache = ALOG_STALE;
+		rc = !send_cached(client_fd, stale, range, ifrange, client_keep, &rec) && client_keep;
+	}
+#endif
 
-	return 0;
+out:
+#ifdef CACHE_ENABLED
+	/* Wake the requests that waited for this fetch */
+	if (leader)
+		flight_end(&flights, cache_key);
+	if (stale)
+		obj_release(stale);
+#endif
+	stats_request(&stats, &rec);
+	alog_end(&access_log, &rec);
+	return rc;
 }
-
@@ -0,0 +1,28 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "dns.h"
+#include "alog.h"
+#include "stats.h"
+#include "http.h"
+
+#define CACHE_ENABLED
+
+/* seconds past its expiry a stale object is served while it is refreshed */
+#define CACHE_GRACE 30
+
+#ifdef CACHE_ENABLED
+extern cache_t cache;
+#endif
+extern dns_t resolver;
+extern alog_t access_log;
+extern stats_t stats;
+
+/* shared by the threaded and the event-driven engines */
+#ifdef CACHE_ENABLED
+int refresh_stale(char *uri, time_t expires);
+#endif
+
+#endif /* __PROXY_H__ */
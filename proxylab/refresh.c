@@ -0,0 +1,60 @@
+#include "refresh.h"
+
+/*************************
+ * refresh_t static methods
+ *************************/
+
+/* refresh thread */
+static void *refresh_thread(void *vargp)
+{
+	refresh_t *rq = vargp;
+	char *uri;
+
+	Pthread_detach(Pthread_self());
+	while (1) {
+		P(&rq->items);
+		P(&rq->mutex);
+		uri = rq->buf[(++rq->front) % (rq->n)];
+		V(&rq->mutex);
+		V(&rq->slots);
+
+		rq->fn(uri);
+		free(uri);
+	}
+
+	return NULL;
+}
+
+/********************
+ * refresh_t APIs
+ ********************/
+
+void refresh_init(refresh_t *rq, int nthreads, int n, void (*fn)(char *uri))
+{
+	pthread_t tid;
+	int i;
+
+	rq->buf = Calloc(n, sizeof(char *));
+	rq->n = n;
+	rq->front = rq->rear = 0;
+	rq->fn = fn;
+	Sem_init(&rq->mutex, 0, 1);
+	Sem_init(&rq->slots, 0, n);
+	Sem_init(&rq->items, 0, 0);
+
+	for (i = 0; i < nthreads; i++)
+		Pthread_create(&tid, NULL, refresh_thread, rq);
+}
+
+/* Queues a copy of uri; returns -1 instead of blocking when full */
+int refresh_submit(refresh_t *rq, char *uri)
+{
+	if (sem_trywait(&rq->slots) < 0)
+		return -1;
+
+	P(&rq->mutex);
+	rq->buf[(++rq->rear) % (rq->n)] = strdup(uri);
+	V(&rq->mutex);
+	V(&rq->items);
+	return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef __REFRESH_H__
+#define __REFRESH_H__
+
+#include "csapp.h"
+
+/* background refresh threads and pending refreshes */
+#define REFRESH_THREADS 2
+#define REFRESH_QUEUE 64
+
+/* seconds a refresh waits on a silent origin */
+#define REFRESH_TIMEOUT 10
+
+/********************
+ * data structures
+ ********************/
+
+/* bounded FIFO of URIs to refresh, drained by the refresh threads */
+typedef struct {
+	char **buf;
+	int n;
+	int front;
+	int rear;
+	sem_t mutex;
+	sem_t slots;
+	sem_t items;
+	void (*fn)(char *uri);	/* does the refresh */
+} refresh_t;
+
+/* refresh_t APIs */
+void refresh_init(refresh_t *rq, int nthreads, int n, void (*fn)(char *uri));
+int refresh_submit(refresh_t *rq, char *uri);
+
+#endif /* __REFRESH_H__ */
@@ -0,0 +1,18 @@
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <sys/types.h>
+
+/* bodies shorter than this are cheaper to copy than to splice */
+#define RELAY_MIN_SIZE (64 << 10)
+
+/* capacity asked of the relay pipe, in bytes */
+#define RELAY_PIPE_SIZE (256 << 10)
+
+/* relay_body returns this if splice cannot be used and nothing was moved */
+#define RELAY_UNSUPPORTED -2
+
+/* relay APIs */
+int relay_body(int from, int to, ssize_t n, ssize_t *moved);
+
+#endif /* __RELAY_H__ */
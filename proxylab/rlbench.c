@@ -0,0 +1,189 @@
+/*
+ * rlbench.c - micro-benchmark of the rio line readers
+ *
+ * rlbench writes a file of response header blocks, then reads it back
+ * line by line with the old byte-at-a-time reader (kept here as it was
+ * in csapp.c), with rio_readlineb, which copies whole lines found with
+ * memchr, and with rio_readlinep, which returns them in place. Every
+ * pass rereads the whole file from the page cache, and the best of the
+ * passes is reported in ns per line.
+ *
+ * usage: rlbench [-n <blocks>] [-r <passes>]
+ */
+
+/**************************************************
+ * [2013-11706] Kang Injae,
+ * Dept. of Mechanical & Aerospace Engineering
+ **************************************************/
+
+#include "csapp.h"
+
+#define DEF_BLOCKS 20000
+#define DEF_PASSES 5
+
+static char *block =
+	"HTTP/1.1 200 OK\r\n"
+	"Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+	"Server: Apache/2.4.41 (Ubuntu)\r\n"
+	"Last-Modified: Sat, 05 Nov 1994 11:02:13 GMT\r\n"
+	"ETag: \"2aa6-53e1f2c4b7a80\"\r\n"
+	"Accept-Ranges: bytes\r\n"
+	"Content-Length: 10918\r\n"
+	"Cache-Control: max-age=3600, public\r\n"
+	"Vary: Accept-Encoding\r\n"
+	"Keep-Alive: timeout=5, max=100\r\n"
+	"Connection: Keep-Alive\r\n"
+	"Content-Type: text/html; charset=UTF-8\r\n"
+	"\r\n";
+
+/********************
+ * line readers
+ ********************/
+
+/* the rio_read of csapp.c, which is static there */
+static ssize_t byte_read(rio_t *rp, char *usrbuf, size_t n)
+{
+	int cnt;
+
+	while (rp->rio_cnt <= 0) {
+		rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+		if (rp->rio_cnt < 0) {
+			if (errno != EINTR)
+				return -1;
+		}
+		else if (rp->rio_cnt == 0)
+			return 0;
+		else
+			rp->rio_bufptr = rp->rio_buf;
+	}
+
+	cnt = n;
+	if (rp->rio_cnt < n)
+		cnt = rp->rio_cnt;
+	memcpy(usrbuf, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	return cnt;
+}
+
+/* the rio_readlineb of csapp.c before it used memchr */
+static ssize_t byte_readline(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+	int n, rc;
+	char c, *bufp = usrbuf;
+
+	for (n = 1; n < maxlen; n++) {
+		if ((rc = byte_read(rp, &c, 1)) == 1) {
+			*bufp++ = c;
+			if (c == '\n') {
+				n++;
+				break;
+			}
+		}
+		else if (rc == 0) {
+			if (n == 1)
+				return 0;
+			else
+				break;
+		}
+		else
+			return -1;
+	}
+	*bufp = 0;
+	return n - 1;
+}
+
+/********************
+ * benchmark
+ ********************/
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Reads the file once with reader 0, 1 or 2; returns the lines read */
+static long pass(int fd, int reader, long *bytes)
+{
+	char buf[MAXBUF], *line;
+	long lines = 0;
+	ssize_t n;
+	rio_t rio;
+
+	lseek(fd, 0, SEEK_SET);
+	rio_readinitb(&rio, fd);
+	*bytes = 0;
+	while (1) {
+		if (reader == 0)
+			n = byte_readline(&rio, buf, MAXBUF);
+		else if (reader == 1)
+			n = rio_readlineb(&rio, buf, MAXBUF);
+		else
+			n = rio_readlinep(&rio, &line);
+		if (n <= 0)
+			break;
+		*bytes += n;
+		lines++;
+	}
+	return lines;
+}
+
+int main(int argc, char **argv)
+{
+	static char *names[] = { "byte-at-a-time", "rio_readlineb", "rio_readlinep" };
+	char path[] = "/tmp/rlbenchXXXXXX";
+	int c, fd, i, r, nblocks = DEF_BLOCKS, npasses = DEF_PASSES;
+	double t, best[3] = { 0, 0, 0 };
+	long lines = 0, bytes = 0, expect = 0;
+
+	while ((c = getopt(argc, argv, "n:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			nblocks = atoi(optarg);
+			break;
+		case 'r':
+			npasses = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || nblocks < 1 || npasses < 1)
+		goto usage;
+
+	if ((fd = mkstemp(path)) < 0)
+		unix_error("mkstemp error");
+	unlink(path);
+	for (i = 0; i < nblocks; i++)
+		Rio_writen(fd, block, strlen(block));
+
+	for (r = 0; r < npasses; r++) {
+		for (i = 0; i < 3; i++) {
+			t = now_ns();
+			lines = pass(fd, i, &bytes);
+			t = now_ns() - t;
+			if (!expect)
+				expect = bytes;
+			if (bytes != expect) {
+				fprintf(stderr, "%s read %ld bytes, not %ld\n", names[i], bytes, expect);
+				exit(1);
+			}
+			if (!r || t < best[i])
+				best[i] = t;
+		}
+	}
+
+	printf("%ld lines, %ld bytes, best of %d passes\n", lines, bytes, npasses);
+	for (i = 0; i < 3; i++)
+		printf("%-16s %8.2f ns/line %8.1f MB/s %6.2fx\n", names[i], best[i] / lines,
+		       bytes / best[i] * 1e3, best[0] / best[i]);
+	Close(fd);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-n <blocks>] [-r <passes>]\n", argv[0]);
+	exit(1);
+}
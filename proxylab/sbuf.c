@@ -0,0 +1,55 @@
+#include "sbuf.h"
+
+/********************
+ * sbuf_t APIs
+ ********************/
+
+void sbuf_init(sbuf_t *sp, int n)
+{
+	sp->buf = Calloc(n, sizeof(int));
+	sp->n = n;
+	sp->front = sp->rear = 0;
+	Sem_init(&sp->mutex, 0, 1);
+	Sem_init(&sp->slots, 0, n);
+	Sem_init(&sp->items, 0, 0);
+}
+
+void sbuf_deinit(sbuf_t *sp)
+{
+	Free(sp->buf);
+}
+
+/* Blocks while the buffer is full */
+void sbuf_insert(sbuf_t *sp, int item)
+{
+	P(&sp->slots);
+	P(&sp->mutex);
+	sp->buf[(++sp->rear) % (sp->n)] = item;
+	V(&sp->mutex);
+	V(&sp->items);
+}
+
+/* Returns -1 instead of blocking when the buffer is full */
+int sbuf_tryinsert(sbuf_t *sp, int item)
+{
+	if (sem_trywait(&sp->slots) < 0)
+		return -1;
+
+	P(&sp->mutex);
+	sp->buf[(++sp->rear) % (sp->n)] = item;
+	V(&sp->mutex);
+	V(&sp->items);
+	return 0;
+}
+
+int sbuf_remove(sbuf_t *sp)
+{
+	int item;
+
+	P(&sp->items);
+	P(&sp->mutex);
+	item = sp->buf[(++sp->front) % (sp->n)];
+	V(&sp->mutex);
+	V(&sp->slots);
+	return item;
+}
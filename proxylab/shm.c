@@ -0,0 +1,223 @@
+#include "shm.h"
+
+/*
+ * Memory shared by the worker processes. The mapping is made before they
+ * are forked, so it sits at the same address in all of them and plain
+ * pointers into it mean the same thing everywhere. Blocks are handed out
+ * by a binary buddy allocator: every block spans a power of two, a free
+ * block is merged with its buddy whenever that is free as well, and a
+ * block knows its own arena, so it can be freed without one.
+ *
+ * The lock is robust, and a worker killed while holding it may leave
+ * the free lists half linked. The dirty flag is up while they change,
+ * and the next locker that finds it up rebuilds them from the block
+ * headers, walking the arena from its start. The headers are written
+ * so that the walk always lands on whole blocks: a block is split by
+ * writing the headers of its halves before its own order shrinks, and
+ * merged by growing the order of the front half before the header of
+ * the back half is cleared. A block being freed counts as free at once;
+ * one marked used for a holder that died is lost with it.
+ */
+
+/* keeps the compiler from moving header stores a kill may land between */
+#define SHM_BARRIER() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+
+/*************************
+ * shm_t static methods
+ *************************/
+
+static int shm_order(size_t size)
+{
+	int order = SHM_MIN_ORDER;
+
+	while (((size_t)1 << order) < size)
+		order++;
+	return order;
+}
+
+static void shm_push(shm_t *shm, shmblk_t *blk, int order)
+{
+	blk->magic = SHM_FREE;
+	blk->order = order;
+	blk->shm = shm;
+	blk->prev = NULL;
+	blk->next = shm->free[order];
+	if (blk->next)
+		blk->next->prev = blk;
+	shm->free[order] = blk;
+}
+
+static void shm_take(shm_t *shm, shmblk_t *blk)
+{
+	if (blk->prev)
+		blk->prev->next = blk->next;
+	else
+		shm->free[blk->order] = blk->next;
+	if (blk->next)
+		blk->next->prev = blk->prev;
+}
+
+static shmblk_t *shm_buddy(shm_t *shm, shmblk_t *blk, int order)
+{
+	return (shmblk_t *)(shm->base + (((char *)blk - shm->base) ^ ((size_t)1 << order)));
+}
+
+/* Relinks the free lists from the block headers */
+static void shm_rebuild(shm_t *shm)
+{
+	char *pos = shm->base, *end = shm->base + shm->size;
+	shmblk_t *blk;
+
+	memset(shm->free, 0, sizeof(shm->free));
+	shm->used = 0;
+	for (; pos < end; pos += (size_t)1 << blk->order) {
+		blk = (shmblk_t *)pos;
+		if ((blk->magic != SHM_FREE && blk->magic != SHM_USED) ||
+		    blk->order < SHM_MIN_ORDER || blk->order > shm->top) {
+			fprintf(stderr, "shm: bad block header at %p, %ld bytes lost\n",
+				pos, (long)(end - pos));
+			shm->used += end - pos;
+			break;
+		}
+		if (blk->magic == SHM_FREE)
+			shm_push(shm, blk, blk->order);
+		else
+			shm->used += (size_t)1 << blk->order;
+	}
+}
+
+static void shm_lock(shm_t *shm)
+{
+	if (pthread_mutex_lock(&shm->lock) == EOWNERDEAD) {
+		if (shm->dirty)
+			shm_rebuild(shm);
+		pthread_mutex_consistent(&shm->lock);
+	}
+	shm->dirty = 1;
+	SHM_BARRIER();
+}
+
+static void shm_unlock(shm_t *shm)
+{
+	SHM_BARRIER();
+	shm->dirty = 0;
+	pthread_mutex_unlock(&shm->lock);
+}
+
+/********************
+ * shm_t APIs
+ ********************/
+
+/*
+ * Maps size bytes, rounded up to whole largest blocks, which are the
+ * smallest power of two that holds largest bytes
+ */
+shm_t *shm_create(size_t size, size_t largest)
+{
+	pthread_mutexattr_t attr;
+	size_t head = (sizeof(shm_t) + 4095) & ~4095UL, top;
+	char *map;
+	shm_t *shm;
+	int order = shm_order(largest + SHM_HDRSIZE);
+
+	top = (size_t)1 << order;
+	size = (size + top - 1) / top * top;
+
+	/* Pages are only backed once touched */
+	map = mmap(NULL, head + size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED)
+		unix_error("mmap error");
+
+	shm = (shm_t *)map;
+	memset(shm, 0, sizeof(shm_t));
+	shm->base = map + head;
+	shm->size = size;
+	shm->top = order;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&shm->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	for (map = shm->base + size - top; map >= shm->base; map -= top)
+		shm_push(shm, (shmblk_t *)map, order);
+
+	return shm;
+}
+
+/* Returns size bytes in shared memory, or NULL if there are none */
+void *shm_alloc(shm_t *shm, size_t size)
+{
+	int order = shm_order(size + SHM_HDRSIZE), i;
+	shmblk_t *blk;
+
+	if (order > shm->top)
+		return NULL;
+
+	shm_lock(shm);
+	for (i = order; i <= shm->top && !shm->free[i]; i++)
+		;
+	if (i > shm->top) {
+		shm_unlock(shm);
+		return NULL;
+	}
+
+	/* Split the block down, keeping the front half each time */
+	blk = shm->free[i];
+	shm_take(shm, blk);
+	while (i > order) {
+		i--;
+		shm_push(shm, shm_buddy(shm, blk, i), i);
+	}
+
+	SHM_BARRIER();
+	blk->order = order;
+	SHM_BARRIER();
+	blk->magic = SHM_USED;
+	shm->used += (size_t)1 << order;
+	shm_unlock(shm);
+
+	return (char *)blk + SHM_HDRSIZE;
+}
+
+void shm_free(void *ptr)
+{
+	shmblk_t *blk = (shmblk_t *)((char *)ptr - SHM_HDRSIZE), *buddy, *upper;
+	shm_t *shm = blk->shm;
+	int order = blk->order;
+
+	shm_lock(shm);
+	shm->used -= (size_t)1 << order;
+	blk->magic = SHM_FREE;
+
+	/* Merge with the buddy for as long as it is whole and free */
+	while (order < shm->top) {
+		buddy = shm_buddy(shm, blk, order);
+		if (buddy->magic != SHM_FREE || buddy->order != order)
+			break;
+		shm_take(shm, buddy);
+		upper = buddy < blk ? blk : buddy;
+		if (buddy < blk)
+			blk = buddy;
+		blk->order = ++order;
+		SHM_BARRIER();
+		upper->magic = 0;
+	}
+
+	shm_push(shm, blk, order);
+	shm_unlock(shm);
+}
+
+/* The arena a block belongs to */
+shm_t *shm_of(void *ptr)
+{
+	return ((shmblk_t *)((char *)ptr - SHM_HDRSIZE))->shm;
+}
+
+/* Bytes a block takes, its header included */
+long shm_size(void *ptr)
+{
+	return 1L << ((shmblk_t *)((char *)ptr - SHM_HDRSIZE))->order;
+}
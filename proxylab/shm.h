@@ -0,0 +1,47 @@
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include "csapp.h"
+
+/* smallest block, and the most block orders there are */
+#define SHM_MIN_ORDER 6
+#define SHM_ORDERS 48
+
+#define SHM_USED 0x55534544	/* "USED" */
+#define SHM_FREE 0x46524545	/* "FREE" */
+
+/********************
+ * data structures
+ ********************/
+
+/* block header; the links are there only while the block is free */
+typedef struct __shmblk {
+	unsigned int magic;
+	unsigned int order;	/* the block spans 1 << order bytes */
+	struct __shm *shm;
+	struct __shmblk *prev;
+	struct __shmblk *next;
+} shmblk_t;
+
+/* bytes of a used block taken by its header */
+#define SHM_HDRSIZE 16
+
+/* buddy allocator over a shared mapping, placed at its start */
+typedef struct __shm {
+	pthread_mutex_t lock;	/* robust and process-shared */
+	char *base;		/* first block */
+	size_t size;		/* a multiple of the largest block */
+	int top;		/* order of the largest blocks */
+	size_t used;		/* bytes of the blocks handed out */
+	int dirty;		/* set while the free lists are changed */
+	shmblk_t *free[SHM_ORDERS];
+} shm_t;
+
+/* shm_t APIs */
+shm_t *shm_create(size_t size, size_t largest);
+void *shm_alloc(shm_t *shm, size_t size);
+void shm_free(void *ptr);
+shm_t *shm_of(void *ptr);
+long shm_size(void *ptr);
+
+#endif /* __SHM_H__ */
@@ -0,0 +1,199 @@
+#include "stats.h"
+
+/*
+ * Every thread counts into a block of its own, which only it writes, so
+ * counting takes no lock and no shared cache line; a report sums the
+ * blocks as they are at that moment. The connection gauge is counted the
+ * same way, as +1 and -1 on the thread that holds the connection, so
+ * only the sum means anything. Cache size and evictions come from the
+ * shards, read without their locks.
+ */
+
+/*************************
+ * stats_t static methods
+ *************************/
+
+static statsblk_t *stats_blk(stats_t *stats)
+{
+	statsblk_t *blk;
+
+	if ((blk = pthread_getspecific(stats->blk)))
+		return blk;
+
+	blk = Calloc(1, sizeof(statsblk_t));
+	pthread_setspecific(stats->blk, blk);
+
+	/* Readers walk the list without the lock */
+	pthread_mutex_lock(&stats->lock);
+	blk->next = stats->blks;
+	__atomic_store_n(&stats->blks, blk, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&stats->lock);
+
+	return blk;
+}
+
+/* Sums the counters of every thread */
+static void stats_sum(stats_t *stats, long *c)
+{
+	statsblk_t *blk;
+	int i;
+
+	memset(c, 0, STATS_COUNTERS * sizeof(long));
+	for (blk = __atomic_load_n(&stats->blks, __ATOMIC_ACQUIRE); blk; blk = blk->next)
+		for (i = 0; i < STATS_COUNTERS; i++)
+			c[i] += __atomic_load_n(&blk->c[i], __ATOMIC_RELAXED);
+}
+
+static double stats_ratio(long part, long whole)
+{
+	return whole ? (double)part / whole : 0.0;
+}
+
+/* Formats the report body; returns its length, or -1 if it does not fit */
+static int stats_body(stats_t *stats, int json, char *buf, int size)
+{
+	long c[STATS_COUNTERS], cached, cachesize = 0, cnt = 0;
+	unsigned long evictions = 0;
+	int i, n;
+
+	stats_sum(stats, c);
+	if (stats->cache)
+		cache_usage(stats->cache, &cachesize, &cnt, &evictions);
+	cached = c[STATS_HITS] + c[STATS_STALE] + c[STATS_REVALIDATED];
+
+	n = snprintf(buf, size, json ?
+		     "{\"requests\": %ld, \"hits\": %ld, \"stale\": %ld, \"revalidated\": %ld,"
+		     " \"misses\": %ld, \"errors\": %ld, \"hit_ratio\": %.4f,"
+		     " \"byte_hit_ratio\": %.4f, \"cache_bytes\": %ld, \"cache_objects\": %ld,"
+		     " \"evictions\": %lu, \"connections\": %ld, \"upstream_requests\": %ld,"
+		     " \"upstream_latency_mean_ms\": %.3f, \"upstream_latency_ms\": [" :
+		     "requests %ld\nhits %ld\nstale %ld\nrevalidated %ld\n"
+		     "misses %ld\nerrors %ld\nhit_ratio %.4f\n"
+		     "byte_hit_ratio %.4f\ncache_bytes %ld\ncache_objects %ld\n"
+		     "evictions %lu\nconnections %ld\nupstream_requests %ld\n"
+		     "upstream_latency_mean_ms %.3f\n",
+		     c[STATS_REQUESTS], c[STATS_HITS], c[STATS_STALE], c[STATS_REVALIDATED],
+		     c[STATS_MISSES], c[STATS_ERRORS],
+		     stats_ratio(cached, cached + c[STATS_MISSES]),
+		     stats_ratio(c[STATS_HIT_BYTES], c[STATS_HIT_BYTES] + c[STATS_MISS_BYTES]),
+		     cachesize, cnt, evictions, c[STATS_CONNECTIONS], c[STATS_UPSTREAM],
+		     stats_ratio(c[STATS_UPSTREAM_USEC], c[STATS_UPSTREAM]) / 1000);
+
+	/* The histogram, by upper bound; the last bucket has none */
+	for (i = 0; i < STATS_BUCKETS && n < size; i++) {
+		if (json && i < STATS_BUCKETS - 1)
+			n += snprintf(buf + n, size - n, "{\"lt\": %d, \"count\": %ld}, ",
+				      1 << i, c[STATS_LATENCY + i]);
+		else if (json)
+			n += snprintf(buf + n, size - n, "{\"lt\": null, \"count\": %ld}]}\n",
+				      c[STATS_LATENCY + i]);
+		else if (i < STATS_BUCKETS - 1)
+			n += snprintf(buf + n, size - n, "upstream_latency_lt_%dms %ld\n",
+				      1 << i, c[STATS_LATENCY + i]);
+		else
+			n += snprintf(buf + n, size - n, "upstream_latency_ge_%dms %ld\n",
+				      1 << (i - 1), c[STATS_LATENCY + i]);
+	}
+
+	return n < size ? n : -1;
+}
+
+/********************
+ * stats_t APIs
+ ********************/
+
+void stats_init(stats_t *stats, cache_t *cache)
+{
+	stats->cache = cache;
+	stats->blks = NULL;
+	pthread_mutex_init(&stats->lock, NULL);
+	if (pthread_key_create(&stats->blk, NULL))
+		posix_error(errno, "pthread_key_create error");
+}
+
+/* Adds n to a counter of the calling thread */
+void stats_add(stats_t *stats, int counter, long n)
+{
+	statsblk_t *blk = stats_blk(stats);
+
+	/* The only writer; the store only has to be whole for readers */
+	__atomic_store_n(&blk->c[counter], blk->c[counter] + n, __ATOMIC_RELAXED);
+}
+
+/* Counts a request by its access log record */
+void stats_request(stats_t *stats, alogrec_t *rec)
+{
+	stats_add(stats, STATS_REQUESTS, 1);
+	if (!rec->status || rec->status >= 500)
+		stats_add(stats, STATS_ERRORS, 1);
+
+	switch (rec->cache) {
+	case ALOG_HIT:
+		stats_add(stats, STATS_HITS, 1);
+		stats_add(stats, STATS_HIT_BYTES, rec->bytes);
+		break;
+	case ALOG_STALE:
+		stats_add(stats, STATS_STALE, 1);
+		stats_add(stats, STATS_HIT_BYTES, rec->bytes);
+		break;
+	case ALOG_REVALIDATED:
+		stats_add(stats, STATS_REVALIDATED, 1);
+		stats_add(stats, STATS_HIT_BYTES, rec->bytes);
+		break;
+	case ALOG_MISS:
+		stats_add(stats, STATS_MISSES, 1);
+		stats_add(stats, STATS_MISS_BYTES, rec->bytes);
+		break;
+	}
+}
+
+/* Counts the latency of an upstream response whose request began at start */
+void stats_upstream(stats_t *stats, struct timespec *start)
+{
+	struct timespec now;
+	long usec;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+
+	for (i = 0; i < STATS_BUCKETS - 1 && usec >= 1000L << i; i++)
+		;
+	stats_add(stats, STATS_UPSTREAM, 1);
+	stats_add(stats, STATS_UPSTREAM_USEC, usec);
+	stats_add(stats, STATS_LATENCY + i, 1);
+}
+
+/* Is uri that of the report: -1 if not, else 1 for JSON and 0 for text */
+int stats_match(char *uri, int len)
+{
+	int n = strlen(STATS_PATH);
+
+	if (len < n || memcmp(uri, STATS_PATH, n) || (len > n && uri[n] != '?'))
+		return -1;
+
+	for (uri += n, len -= n; len >= 11; uri++, len--)
+		if (!memcmp(uri, "format=json", 11))
+			return 1;
+	return 0;
+}
+
+/* Builds the whole response in buf; returns its length or -1 */
+int stats_response(stats_t *stats, int json, int keep, char *buf, int size)
+{
+	char body[STATS_BODYSIZE];
+	int n, len;
+
+	if ((len = stats_body(stats, json, body, sizeof(body))) < 0)
+		return -1;
+
+	n = snprintf(buf, size, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n"
+		     "Content-Length: %d\r\nCache-Control: no-store\r\nConnection: %s\r\n\r\n",
+		     json ? "application/json" : "text/plain", len,
+		     keep ? "keep-alive" : "close");
+	if (n + len >= size)
+		return -1;
+
+	memcpy(buf + n, body, len);
+	return n + len;
+}
@@ -0,0 +1,57 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "alog.h"
+
+/* the proxy answers for itself at this path; ?format=json for JSON */
+#define STATS_PATH "/__proxy/stats"
+
+/* upstream latency buckets: under 1, 2, 4, ... 1024 ms, and the rest */
+#define STATS_BUCKETS 12
+
+/* longest report body */
+#define STATS_BODYSIZE 4096
+
+/* counters kept per thread */
+#define STATS_CONNECTIONS 0	/* gauge: opened less closed */
+#define STATS_REQUESTS 1
+#define STATS_HITS 2
+#define STATS_STALE 3
+#define STATS_REVALIDATED 4
+#define STATS_MISSES 5
+#define STATS_HIT_BYTES 6	/* body bytes served from the cache */
+#define STATS_MISS_BYTES 7
+#define STATS_ERRORS 8		/* unanswered or 5xx */
+#define STATS_UPSTREAM 9	/* upstream latency samples */
+#define STATS_UPSTREAM_USEC 10
+#define STATS_LATENCY 11	/* first of the STATS_BUCKETS buckets */
+#define STATS_COUNTERS (STATS_LATENCY + STATS_BUCKETS)
+
+/********************
+ * data structures
+ ********************/
+
+/* counters of one thread, written only by it */
+typedef struct __statsblk {
+	long c[STATS_COUNTERS];
+	struct __statsblk *next;
+} statsblk_t;
+
+typedef struct {
+	cache_t *cache;		/* reported on if not NULL */
+	pthread_key_t blk;	/* counters of the calling thread */
+	pthread_mutex_t lock;	/* serializes block registration */
+	statsblk_t *blks;
+} stats_t;
+
+/* stats_t APIs */
+void stats_init(stats_t *stats, cache_t *cache);
+void stats_add(stats_t *stats, int counter, long n);
+void stats_request(stats_t *stats, alogrec_t *rec);
+void stats_upstream(stats_t *stats, struct timespec *start);
+int stats_match(char *uri, int len);
+int stats_response(stats_t *stats, int json, int keep, char *buf, int size);
+
+#endif /* __STATS_H__ */
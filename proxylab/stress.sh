@@ -0,0 +1,133 @@
+#!/bin/bash
+#
+# stress.sh - Fires many concurrent clients at the proxy and checks
+#     that every body comes back byte-for-byte identical to the file
+#     Tiny serves, and that the proxy survives the burst.
+#
+#     usage: ./stress.sh [nclients] [proxy options...]
+#     e.g.   ./stress.sh 300 -e
+#
+
+NCLIENTS=${1:-300}
+shift
+PROXY_ARGS="$@"
+
+HOME_DIR=`pwd`
+STRESS_DIR="./.stress"
+TIMEOUT=20
+MAX_RAND=63000
+PORT_START=1024
+PORT_MAX=65000
+
+FILE_LIST=(home.html csapp.c tiny.c godzilla.jpg godzilla.gif)
+
+#
+# free_port - returns an available unused TCP port
+#
+function free_port {
+    port=$((( RANDOM % ${MAX_RAND}) + ${PORT_START}))
+
+    while [ TRUE ]
+    do
+        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+            | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+            | grep -E "[0-9]+" | uniq | tr "\n" " "`
+
+        echo "${portsinuse}" | grep -wq "${port}"
+        if [ "$?" == "0" ]; then
+            if [ $port -eq ${PORT_MAX} ]
+            then
+                echo "-1"
+                return
+            fi
+            port=`expr ${port} + 1`
+        else
+            echo "${port}"
+            return
+        fi
+    done
+}
+
+#
+# wait_for_port_use - Spins until something listens on the given
+#     TCP port. Gives up after 5 seconds.
+#
+function wait_for_port_use {
+    for i in 1 2 3 4 5 6 7 8 9 10
+    do
+        netstat --numeric-ports --numeric-hosts -ltn \
+            | grep -q ":${1} " && return 0
+        sleep 0.5
+    done
+    return 1
+}
+
+if [ ! -x ./proxy ]
+then
+    echo "Error: ./proxy not found or not an executable file. Please rebuild your proxy."
+    exit 1
+fi
+
+killall -q proxy tiny 2> /dev/null
+rm -rf ${STRESS_DIR}
+mkdir -p ${STRESS_DIR}
+
+# Build a private Tiny from source so a stale ./tiny/tiny can't skew the run
+echo "Building tiny into ${STRESS_DIR}"
+gcc -O2 -I ./tiny -o ${STRESS_DIR}/tiny ./tiny/tiny.c ./tiny/csapp.c -lpthread
+if [ ! -x ${STRESS_DIR}/tiny ]
+then
+    echo "Error: could not build tiny."
+    exit 1
+fi
+
+tiny_port=$(free_port)
+echo "Starting tiny on ${tiny_port}"
+cd ./tiny
+../${STRESS_DIR}/tiny ${tiny_port} &> /dev/null &
+tiny_pid=$!
+cd ${HOME_DIR}
+wait_for_port_use "${tiny_port}"
+
+proxy_port=$(free_port)
+echo "Starting proxy on ${proxy_port} ${PROXY_ARGS}"
+./proxy ${PROXY_ARGS} ${proxy_port} &> /dev/null &
+proxy_pid=$!
+wait_for_port_use "${proxy_port}"
+
+echo "Fetching with ${NCLIENTS} concurrent clients"
+pids=""
+for i in `seq 1 ${NCLIENTS}`
+do
+    file=${FILE_LIST[$(( i % ${#FILE_LIST[@]} ))]}
+    curl --max-time ${TIMEOUT} --silent --proxy http://localhost:${proxy_port} \
+        --output ${STRESS_DIR}/${i}.${file} http://localhost:${tiny_port}/${file} &
+    pids="${pids} $!"
+done
+wait ${pids}
+
+bad=0
+for i in `seq 1 ${NCLIENTS}`
+do
+    file=${FILE_LIST[$(( i % ${#FILE_LIST[@]} ))]}
+    if ! cmp -s ${STRESS_DIR}/${i}.${file} ./tiny/${file}
+    then
+        echo "Failure: client ${i} got a bad ${file}"
+        bad=`expr ${bad} + 1`
+    fi
+done
+
+alive=1
+kill -0 ${proxy_pid} 2> /dev/null || alive=0
+
+kill ${proxy_pid} ${tiny_pid} 2> /dev/null
+wait 2> /dev/null
+rm -rf ${STRESS_DIR}
+
+echo "clients=${NCLIENTS} bad=${bad}"
+if [ ${alive} -eq 0 ]
+then
+    echo "Failure: the proxy died under load"
+    exit 1
+fi
+[ ${bad} -eq 0 ]
@@ -149,25 +149,34 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 void serve_static(int fd, char *filename, int filesize) 
 {
     int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
+    char *srcp = NULL, filetype[32], buf[MAXBUF];
+    struct iovec iov[2];
  
-    /* Send response headers to client */
+    /* Build response headers */
     get_filetype(filename, filetype);       //line:netp:servestatic:getfiletype
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");    //line:netp:servestatic:beginserve
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-    Rio_writen(fd, buf, strlen(buf));       //line:netp:servestatic:endserve
+    snprintf(buf, sizeof(buf), "HTTP/1.0 200 OK\r\n" //line:netp:servestatic:beginserve
+	    "Server: Tiny Web Server\r\n"
+	    "Connection: close\r\n"
+	    "Content-length: %d\r\n"
+	    "Content-type: %s\r\n\r\n", filesize, filetype);
     printf("Response headers:\n");
     printf("%s", buf);
 
-    /* Send response body to client */
-    srcfd = Open(filename, O_RDONLY, 0);    //line:netp:servestatic:open
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);//line:netp:servestatic:mmap
-    Close(srcfd);                           //line:netp:servestatic:close
-    Rio_writen(fd, srcp, filesize);         //line:netp:servestatic:write
-    Munmap(srcp, filesize);                 //line:netp:servestatic:munmap
+    /* Map the response body; an empty file cannot be mapped */
+    if (filesize > 0) {
+	srcfd = Open(filename, O_RDONLY, 0);    //line:netp:servestatic:open
+	srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);//line:netp:servestatic:mmap
+	Close(srcfd);                           //line:netp:servestatic:close
+    }
+
+    /* Send headers and body to client in one gathered write */
+    iov[0].iov_base = buf;
+    iov[0].iov_len = strlen(buf);
+    iov[1].iov_base = srcp;
+    iov[1].iov_len = filesize;
+    Rio_writev(fd, iov, 2);                 //line:netp:servestatic:write
+    if (srcp)
+	Munmap(srcp, filesize);                 //line:netp:servestatic:munmap
 }
 
 /*
@@ -197,9 +206,7 @@ void serve_dynamic(int fd, char *filename, char *cgiargs)
     char buf[MAXLINE], *emptylist[] = { NULL };
 
     /* Return first part of HTTP response */
-    sprintf(buf, "HTTP/1.0 200 OK\r\n"); 
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
+    sprintf(buf, "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\n"); 
     Rio_writen(fd, buf, strlen(buf));
   
     if (Fork() == 0) { /* Child */ //line:netp:servedynamic:fork
@@ -220,21 +227,23 @@ void clienterror(int fd, char *cause, char *errnum,
 		 char *shortmsg, char *longmsg) 
 {
     char buf[MAXLINE], body[MAXBUF];
+    struct iovec iov[2];
 
     /* Build the HTTP response body */
-    sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
+    snprintf(body, sizeof(body), "<html><title>Tiny Error</title>"
+	     "<body bgcolor=""ffffff"">\r\n"
+	     "%s: %s\r\n"
+	     "<p>%s: %s\r\n"
+	     "<hr><em>The Tiny Web server</em>\r\n",
+	     errnum, shortmsg, longmsg, cause);
 
     /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    snprintf(buf, sizeof(buf), "HTTP/1.0 %s %s\r\nContent-type: text/html\r\n"
+	     "Content-length: %d\r\n\r\n", errnum, shortmsg, (int)strlen(body));
+    iov[0].iov_base = buf;
+    iov[0].iov_len = strlen(buf);
+    iov[1].iov_base = body;
+    iov[1].iov_len = strlen(body);
+    Rio_writev(fd, iov, 2);
 }
 /* $end clienterror */